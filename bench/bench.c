@@ -0,0 +1,225 @@
+#define _GNU_SOURCE
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+struct client {
+  double started;
+  int fd;
+};
+
+static struct sockaddr_storage address;
+static socklen_t length;
+static double *latencies;
+static size_t count, errors, size;
+
+static double monotonic(void) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static int compare(const void *a, const void *b) {
+  double x = *(const double *) a, y = *(const double *) b;
+  return x < y ? -1 : x > y;
+}
+
+static void record(double latency) {
+  if (count == size) {
+    size = size ? 2 * size : 4096;
+    if (!(latencies = realloc(latencies, size * sizeof(double))))
+      err(EXIT_FAILURE, "realloc");
+  }
+  latencies[count++] = latency;
+}
+
+static void report(const char *name, double elapsed) {
+  /* Report a rate for timed runs or a count for fixed rounds. */
+  qsort(latencies, count, sizeof(double), compare);
+  if (elapsed > 0)
+    printf("%-28s %8.0f/s", name, count / elapsed);
+  else
+    printf("%-28s %6zu runs", name, count);
+  printf("  p50 %7.3fms  p99 %7.3fms  %zu errors\n",
+    count ? 1e3 * latencies[count / 2] : 0,
+    count ? 1e3 * latencies[count * 99 / 100] : 0, errors);
+}
+
+static void resolve(const char *target) {
+  struct addrinfo hints = { .ai_socktype = SOCK_STREAM }, *info;
+  struct sockaddr_un *local = (struct sockaddr_un *) &address;
+  char host[256], port[32];
+  int status;
+
+  /* Anything with a slash is a unix socket, otherwise HOST:PORT. */
+  if (strchr(target, '/')) {
+    if (strlen(target) >= sizeof(local->sun_path))
+      errx(EXIT_FAILURE, "%s: Path is too long", target);
+    local->sun_family = AF_UNIX;
+    strcpy(local->sun_path, target);
+    length = sizeof(struct sockaddr_un);
+    return;
+  }
+
+  if (sscanf(target, "%255[^:]:%31s", host, port) < 2)
+    errx(EXIT_FAILURE, "%s: Invalid address", target);
+  if ((status = getaddrinfo(host, port, &hints, &info)) != 0)
+    errx(EXIT_FAILURE, "getaddrinfo: %s", gai_strerror(status));
+  memcpy(&address, info->ai_addr, info->ai_addrlen);
+  length = info->ai_addrlen;
+  freeaddrinfo(info);
+}
+
+static void start(int epoll, struct client *client) {
+  struct epoll_event event = { .events = EPOLLIN, .data.ptr = client };
+
+  client->started = monotonic();
+  client->fd = socket(address.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  if (client->fd < 0)
+    err(EXIT_FAILURE, "socket");
+
+  /* A full unix backlog fails with EAGAIN rather than blocking. */
+  if (connect(client->fd, (struct sockaddr *) &address, length) < 0)
+    if (errno != EINPROGRESS) {
+      errors++;
+      close(client->fd);
+      client->fd = -1;
+      return;
+    }
+  if (epoll_ctl(epoll, EPOLL_CTL_ADD, client->fd, &event) < 0)
+    err(EXIT_FAILURE, "epoll_ctl");
+}
+
+static int connections(const char *target, int parallel, double duration) {
+  struct epoll_event events[64];
+  struct client *clients, *client;
+  double deadline, started;
+  int epoll, ready;
+  char byte;
+
+  resolve(target);
+  if (!(clients = calloc(parallel, sizeof(struct client))))
+    err(EXIT_FAILURE, "calloc");
+  if ((epoll = epoll_create1(EPOLL_CLOEXEC)) < 0)
+    err(EXIT_FAILURE, "epoll_create1");
+
+  /* Keep PARALLEL clients in flight, timing connect to first byte. */
+  started = monotonic();
+  deadline = started + duration;
+  for (int i = 0; i < parallel; i++)
+    start(epoll, clients + i);
+
+  while (monotonic() < deadline) {
+    if ((ready = epoll_wait(epoll, events, 64, 1)) < 0)
+      if (errno != EINTR)
+        err(EXIT_FAILURE, "epoll_wait");
+
+    for (int i = 0; i < ready; i++) {
+      client = events[i].data.ptr;
+      if (read(client->fd, &byte, 1) == 1)
+        record(monotonic() - client->started);
+      else
+        errors++;
+      close(client->fd);
+      start(epoll, client);
+    }
+
+    /* Retry clients whose connect() was refused outright. */
+    for (int i = 0; i < parallel; i++)
+      if (clients[i].fd < 0)
+        start(epoll, clients + i);
+  }
+
+  report(target, monotonic() - started);
+  return EXIT_SUCCESS;
+}
+
+static int awaits(const char *dir, int rounds, char *daemon, char *self) {
+  char fifo[4096], path[4096], stamp[32];
+  double created;
+  ssize_t size;
+  int fd, status;
+
+  if (!(self = realpath(self, NULL)))
+    err(EXIT_FAILURE, "realpath");
+  snprintf(fifo, sizeof(fifo), "%s/stamp", dir);
+  if (mkfifo(fifo, 0600) < 0)
+    err(EXIT_FAILURE, "%s", fifo);
+
+  for (int i = 0; i < rounds; i++) {
+    snprintf(path, sizeof(path), "%s/await.%d", dir, i);
+
+    /* The daemon backgrounds itself with stdout on /dev/null, then execs
+       us as 'stamp' once PATH exists to write the time to our FIFO. */
+    switch (fork()) {
+      case -1:
+        err(EXIT_FAILURE, "fork");
+      case 0:
+        execl(daemon, daemon, "-w", path, self, "stamp", fifo, NULL);
+        err(EXIT_FAILURE, "exec %s", daemon);
+    }
+    if (wait(&status) < 0 || !WIFEXITED(status) || WEXITSTATUS(status))
+      errx(EXIT_FAILURE, "%s failed to start", daemon);
+    usleep(50000);
+
+    created = monotonic();
+    if ((fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644)) < 0)
+      err(EXIT_FAILURE, "%s", path);
+    close(fd);
+
+    if ((fd = open(fifo, O_RDONLY | O_CLOEXEC)) < 0)
+      err(EXIT_FAILURE, "%s", fifo);
+    if ((size = read(fd, stamp, sizeof(stamp) - 1)) > 0) {
+      stamp[size] = 0;
+      record(strtod(stamp, NULL) - created);
+    } else {
+      errors++;
+    }
+    close(fd);
+    unlink(path);
+  }
+  unlink(fifo);
+
+  report("-w path to exec", 0);
+  return EXIT_SUCCESS;
+}
+
+static int stamp(const char *fifo) {
+  double now = monotonic();
+  int fd;
+
+  if ((fd = open(fifo, O_WRONLY)) < 0)
+    err(EXIT_FAILURE, "%s", fifo);
+  return dprintf(fd, "%.9f\n", now) < 0;
+}
+
+int main(int argc, char **argv) {
+  if (argc == 3 && !strcmp(argv[1], "stamp"))
+    return stamp(argv[2]);
+  if (argc == 5 && !strcmp(argv[1], "connect"))
+    return connections(argv[2], atoi(argv[3]), atof(argv[4]));
+  if (argc == 5 && !strcmp(argv[1], "await"))
+    return awaits(argv[2], atoi(argv[3]), argv[4], argv[0]);
+
+  fprintf(stderr, "\
+Usage: %1$s connect PATH|HOST:PORT CLIENTS SECONDS\n\
+       %1$s await DIR ROUNDS DAEMON\n\
+The first form keeps CLIENTS connections in flight for SECONDS and reports\n\
+the connection rate and the time from connect() to the first byte read.\n\
+The second runs 'DAEMON -w DIR/await.N' ROUNDS times and reports the time\n\
+from creating the path to the command starting.\n\
+", argv[0]);
+  return 64;
+}
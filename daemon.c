@@ -1,4 +1,5 @@
 #define _GNU_SOURCE
+#define SYSLOG_NAMES
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -6,122 +7,591 @@
 #include <netdb.h>
 #include <poll.h>
 #include <pwd.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdarg.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <syslog.h>
 #include <time.h>
 #include <unistd.h>
+#include <arpa/inet.h>
+#include <linux/filter.h>
+#include <linux/sched.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
 #include <sys/file.h>
 #include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/un.h>
 #include <sys/wait.h>
 
+#define LOG_BATCH 64
+#define LOG_BUFFER 8192
+#define LOG_LINE 1024
+#define LOG_OUTPUT 16384
+#define PEER_VARS 5
+#define POOL_GRACE 0.02
+#define POOL_IDLE 10
+#define SERVE_EVENTS 64
+#define SPAWN_STACK 65536
+#define STATUS_INTERVAL 1
+
+struct logger {
+  char *buffer, *header, *output, *tag;
+  size_t keep, length, limit, used, written;
+  int file, pipe[2];
+};
+
 static id_t gid, uid;
-static size_t listeners;
-static struct inotify_event *event;
+static size_t awaiting, listeners, managed, shards = 1, *owners;
 static struct pollfd *pollfd;
-static int signals[2];
+static int activate, cgroup = -1, cwd, failed, inotify = -1, notify = -1;
+static int steer;
+static int signals[2], stopping;
+static volatile sig_atomic_t hangup;
+static FILE *console;
+
+static struct {
+  double min, max;
+} backoff = { 1, 60 };
+
+static struct {
+  double life, idle;
+} expiry;
+
+static struct stats {
+  size_t accepted, active, expired, refused;
+} *stats;
+
+static struct {
+  char *path, *temp, text[256];
+  double due, written;
+  pid_t child, owner;
+  time_t since, started;
+  unsigned long restarts;
+  int status;
+} statusfile = { .status = -1 };
+
+static struct tuning {
+  cpu_set_t cpus;
+  struct rlimit limits[RLIM_NLIMITS];
+  int affinity, ioprio, nice, niced, policy, priority, resources;
+} tuning = { .ioprio = -1, .policy = -1 };
+
+static struct service {
+  char *name, *pidfile, **argv, **words;
+  struct logger log;
+  size_t *needs, needed, pending;
+  int cgroup, count, notify, ready, restart, session, state, up;
+  id_t gid, uid;
+  pid_t pid;
+  time_t started;
+} *services;
+
+enum { WAITING, RUNNING, DONE, FAILED };
+
+static struct await {
+  char *path, *copy, *rest;
+  int dir, watch;
+  size_t owner;
+} *awaits;
+
+static struct logger logger = { .file = -1, .pipe = { -1, -1 } };
+
+static struct peer {
+  char **env, source[INET6_ADDRSTRLEN];
+  char vars[PEER_VARS][INET6_ADDRSTRLEN + 16];
+  size_t base;
+} peer;
+
+static struct client {
+  char source[INET6_ADDRSTRLEN];
+  double active, started;
+  int expired, fd;
+  pid_t pid;
+} *clients;
+static size_t clients_size;
 
 static struct {
-  char *priority, *tag;
+  struct mmsghdr messages[LOG_BATCH];
+  struct iovec vectors[LOG_BATCH][2];
+  size_t count;
   int fd;
-} logger;
+  pid_t owner;
+} syslogs = { .fd = -1 };
 
 static struct {
-  char *path;
+  char *path, *ready;
   int fd;
 } pidfile;
 
-static void await(char *path, int inotify, int parent) {
-  struct pollfd fd = { .fd = inotify, .events = POLLIN };
+static struct {
+  char *name;
+  int fd;
+} timeline = { .fd = -1 };
+
+static void timeline_add(const char *name, const char *format, ...) {
+  char line[PATH_MAX + 256];
+  struct timespec now;
+  va_list args;
+  size_t length;
+
+  if (timeline.fd < 0)
+    return;
+  clock_gettime(CLOCK_BOOTTIME, &now);
+  length = snprintf(line, sizeof(line), "%lld.%06ld %s ",
+    (long long) now.tv_sec, now.tv_nsec / 1000,
+    name ? name : timeline.name ? timeline.name : "daemon");
+  if (length >= sizeof(line))
+    length = sizeof(line) - 1;
+  va_start(args, format);
+  length += vsnprintf(line + length, sizeof(line) - length, format, args);
+  va_end(args);
+
+  /* Append each event in a single write so daemons can share the file. */
+  if (length >= sizeof(line))
+    length = sizeof(line) - 1;
+  line[length++] = '\n';
+  if (write(timeline.fd, line, length) < 0)
+    return; /* Timeline events are best-effort only. */
+}
+
+static void timeline_exit(const char *name, int status) {
+  if (WIFSIGNALED(status))
+    timeline_add(name, "signal %d", WTERMSIG(status));
+  else
+    timeline_add(name, "exit %d", WEXITSTATUS(status));
+}
+
+static int await_step(struct await *wait) {
   struct stat test;
-  char *slash;
-  int watch;
+  char *next, save;
+  int dir, leaf;
+
+  while (1) {
+    wait->rest += strspn(wait->rest, "/");
+    if (*wait->rest == 0)
+      return 1;
+
+    /* Temporarily terminate the next component of the path. */
+    next = wait->rest + strcspn(wait->rest, "/");
+    leaf = next[strspn(next, "/")] == 0;
+    save = *next, *next = 0;
+
+    /* Parent components must be dirs but the leaf can be anything. */
+    if (leaf)
+      dir = fstatat(wait->dir, wait->rest, &test, AT_SYMLINK_NOFOLLOW);
+    else
+      dir = openat(wait->dir, wait->rest, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    *next = save;
+
+    if (dir >= 0) {
+      if (!leaf) {
+        close(wait->dir);
+        wait->dir = dir;
+        wait->watch = -1;
+      }
+      wait->rest = next;
+      continue;
+    }
 
-  /* Take a short-cut if path already exists and is a parent dir. */
-  if (parent) {
-    if (chdir(path) >= 0)
-      return;
     if (errno != ENOENT)
-      err(EXIT_FAILURE, "chdir %s", path);
+      err(EXIT_FAILURE, "%s", wait->path);
+    if (wait->watch >= 0)
+      return 0;
+
+    /* Watch for the component to arrive, then check again to avoid a race. */
+    if (fchdir(wait->dir) < 0)
+      err(EXIT_FAILURE, "fchdir");
+    wait->watch = inotify_add_watch(inotify, ".", IN_CREATE | IN_MOVED_TO);
+    if (wait->watch < 0)
+      err(EXIT_FAILURE, "inotify_add_watch");
+    if (fchdir(cwd) < 0)
+      err(EXIT_FAILURE, "fchdir");
   }
+}
 
-  /* If leading slashes are present, chdir to the root and remove them. */
-  if (*path == '/') {
-    if (chdir("/") < 0)
-      err(EXIT_FAILURE, "chdir /");
-    while (*path == '/')
-      path++;
+static int await_add(char *path, size_t owner) {
+  struct await *wait;
+
+  if (inotify < 0) {
+    if ((inotify = inotify_init1(IN_CLOEXEC | IN_NONBLOCK)) < 0)
+      err(EXIT_FAILURE, "inotify_init1");
+    if ((cwd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC)) < 0)
+      err(EXIT_FAILURE, "open pwd");
   }
 
-  /* Remove any stray trailing slashes. */
-  slash = strrchr(path, '/');
-  if (slash && slash[1] == 0) {
-    while (*slash == '/')
-      *slash-- = 0;
-    slash = strrchr(path, '/');
+  if ((awaiting & 15) == 0) {
+    awaits = realloc(awaits, (awaiting + 16) * sizeof(struct await));
+    if (awaits == NULL)
+      err(EXIT_FAILURE, "realloc");
   }
 
-  /* Recurse to await the parent dir if necessary. */
-  if (slash) {
-    *slash = 0;
-    await(path, inotify, 1);
-    path = slash + 1;
+  /* Each path is followed from the deepest directory found so far. */
+  wait = awaits + awaiting;
+  wait->path = path;
+  if (!(wait->rest = wait->copy = strdup(path)))
+    err(EXIT_FAILURE, "strdup");
+  wait->dir = open(*path == '/' ? "/" : ".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+  if (wait->dir < 0)
+    err(EXIT_FAILURE, "open %s", *path == '/' ? "/" : "pwd");
+  wait->watch = -1;
+  wait->owner = owner;
+
+  if (await_step(wait)) {
+    close(wait->dir);
+    free(wait->copy);
+    return 0;
   }
+  awaiting++;
+  return 1;
+}
+
+static void await_read(void (*done)(size_t owner)) {
+  char buffer[4096]
+    __attribute__ ((aligned(__alignof__(struct inotify_event))));
+  struct inotify_event *event;
+  size_t owner;
+  ssize_t length;
 
-  if (*path == 0)
+  if ((length = read(inotify, buffer, sizeof(buffer))) < 0) {
+    if (errno != EAGAIN && errno != EINTR)
+      err(EXIT_FAILURE, "read");
     return;
+  }
+
+  /* Re-check paths waiting on each watch, or all of them on overflow. */
+  for (char *cursor = buffer; cursor < buffer + length;) {
+    event = (struct inotify_event *) cursor;
+    cursor += sizeof(struct inotify_event) + event->len;
+    for (size_t i = awaiting; i-- > 0;)
+      if (awaits[i].watch == event->wd || event->mask & IN_Q_OVERFLOW)
+        if (await_step(awaits + i)) {
+          owner = awaits[i].owner;
+          timeline_add(done ? services[owner].name : NULL, "found %s",
+            awaits[i].path);
+          close(awaits[i].dir);
+          free(awaits[i].copy);
+          awaits[i] = awaits[--awaiting];
+          if (done)
+            done(owner);
+        }
+  }
+}
 
-  /* Now wait for the correct leaf name to arrive in our working dir. */
-  watch = inotify_add_watch(inotify, ".", IN_CREATE | IN_MOVED_TO);
-  if (watch < 0)
-    err(EXIT_FAILURE, "inotify_add_watch");
+static double monotonic(void) {
+  struct timespec now;
 
-  while (1) {
-    /* Check if it already exists after setting watch to avoid a race. */
-    if (parent) {
-      if (chdir(path) >= 0)
-        goto out;
-      if (errno != ENOENT)
-        err(EXIT_FAILURE, "chdir %s", path);
-    } else {
-      if (lstat(path, &test) >= 0)
-        goto out;
-      if (errno != ENOENT)
-        err(EXIT_FAILURE, "lstat %s", path);
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static void await_all(double timeout) {
+  double deadline = monotonic() + timeout, remaining;
+  int delay = -1;
+
+  while (awaiting) {
+    /* Wake at least once a minute so a long timeout cannot overflow. */
+    if (timeout >= 0) {
+      if ((remaining = deadline - monotonic()) <= 0)
+        errx(EXIT_FAILURE, "Timed out waiting for %s", awaits->path);
+      delay = remaining < 60 ? 1 + 1000 * remaining : 60000;
     }
 
-    if (event == NULL)
-      event = malloc(sizeof(*event) + PATH_MAX + 1);
-    if (event == NULL)
-      err(EXIT_FAILURE, "malloc");
+    while (poll(&(struct pollfd) { inotify, POLLIN }, 1, delay) < 0)
+      if (errno != EAGAIN && errno != EINTR)
+        err(EXIT_FAILURE, "poll");
+    await_read(NULL);
+  }
 
-    /* Otherwise, wait one second for a matching create/move-into event. */
-    while (1) {
-      while (poll(&fd, 1, 1000) < 0)
-        if (errno != EAGAIN && errno != EINTR)
-          err(EXIT_FAILURE, "poll");
-      if (fd.revents == 0)
-        break;
+  /* Watches are left in place as several paths may share each of them. */
+  if (inotify >= 0) {
+    close(inotify);
+    close(cwd);
+    inotify = -1;
+  }
+}
 
-      if (read(inotify, event, sizeof(*event) + PATH_MAX + 1) < 0) {
-        if (errno != EAGAIN && errno != EINTR)
-          err(EXIT_FAILURE, "read");
-        break;
-      }
+static void credentials(char *spec, id_t *uid, id_t *gid) {
+  struct passwd *user;
+  int tail;
+
+  if (sscanf(spec, "%u:%u%n", uid, gid, &tail) >= 2)
+    if (spec[tail] == 0)
+      return;
+  if ((user = getpwnam(spec))) {
+    *uid = user->pw_uid;
+    *gid = user->pw_gid;
+    return;
+  }
+  errx(EXIT_FAILURE, "Invalid username");
+}
 
-      /* Read only succeeds if it can fill the entire struct. */
-      if (!strcmp(path, event->name))
+static void tune_cpus(struct tuning *tuning, char *spec) {
+  long first, last;
+  char *end;
+
+  /* Parse a list of CPUs and ranges such as 0-3,6 as for taskset -c. */
+  CPU_ZERO(&tuning->cpus);
+  do {
+    first = last = strtol(spec, &end, 10);
+    if (end > spec && *end == '-')
+      last = strtol(spec = end + 1, &end, 10);
+    if (end == spec || first < 0 || last < first || last >= CPU_SETSIZE)
+      errx(EXIT_FAILURE, "Invalid CPU list");
+    while (first <= last)
+      CPU_SET(first++, &tuning->cpus);
+    spec = end + 1;
+  } while (*end == ',');
+  if (*end)
+    errx(EXIT_FAILURE, "Invalid CPU list");
+  tuning->affinity = 1;
+}
+
+static void tune_ioprio(struct tuning *tuning, char *spec) {
+  static const char *classes[] = { "none", "realtime", "best-effort", "idle" };
+  char *level;
+  int class = -1, tail;
+
+  /* Parse CLASS[:LEVEL] with the classes and levels of ionice(1). */
+  if ((level = strchr(spec, ':')))
+    *level++ = 0;
+  for (int i = 1; i < 4; i++)
+    if (!strcmp(spec, classes[i]))
+      class = i;
+  tuning->ioprio = class == 3 ? 0 : 4;
+  if (level && (sscanf(level, "%d%n", &tuning->ioprio, &tail) < 1
+        || level[tail] || tuning->ioprio < 0 || tuning->ioprio > 7))
+    class = -1;
+  if (level)
+    level[-1] = ':';
+  if (class < 0)
+    errx(EXIT_FAILURE, "Invalid I/O scheduling class");
+  tuning->ioprio |= class << 13;
+}
+
+static rlim_t tune_value(char *spec, char **end) {
+  *end = spec;
+  if (!strncmp(spec, "unlimited", 9)) {
+    *end = spec + 9;
+    return RLIM_INFINITY;
+  }
+  return *spec >= '0' && *spec <= '9' ? strtoull(spec, end, 10) : 0;
+}
+
+static void tune_limit(struct tuning *tuning, char *spec) {
+  static const struct {
+    const char *name;
+    int resource;
+  } names[] = {
+    { "as", RLIMIT_AS }, { "core", RLIMIT_CORE }, { "cpu", RLIMIT_CPU },
+    { "data", RLIMIT_DATA }, { "fsize", RLIMIT_FSIZE },
+    { "locks", RLIMIT_LOCKS }, { "memlock", RLIMIT_MEMLOCK },
+    { "msgqueue", RLIMIT_MSGQUEUE }, { "nice", RLIMIT_NICE },
+    { "nofile", RLIMIT_NOFILE }, { "nproc", RLIMIT_NPROC },
+    { "rss", RLIMIT_RSS }, { "rtprio", RLIMIT_RTPRIO },
+    { "rttime", RLIMIT_RTTIME }, { "sigpending", RLIMIT_SIGPENDING },
+    { "stack", RLIMIT_STACK }
+  };
+  struct rlimit *limit;
+  size_t i, length = strcspn(spec, "=");
+  char *end;
+
+  /* Parse RESOURCE=SOFT[:HARD], where each may be unlimited. */
+  for (i = 0; i < sizeof(names) / sizeof(*names); i++)
+    if (strlen(names[i].name) == length)
+      if (!strncmp(spec, names[i].name, length))
         break;
-    }
+  if (i == sizeof(names) / sizeof(*names) || spec[length] != '=')
+    errx(EXIT_FAILURE, "Invalid resource limit");
+
+  limit = tuning->limits + names[i].resource;
+  spec += length + 1;
+  limit->rlim_cur = limit->rlim_max = tune_value(spec, &end);
+  if (end > spec && *end == ':')
+    limit->rlim_max = tune_value(spec = end + 1, &end);
+  if (end == spec || *end)
+    errx(EXIT_FAILURE, "Invalid resource limit");
+  tuning->resources |= 1 << names[i].resource;
+}
+
+static void tune_nice(struct tuning *tuning, char *spec) {
+  int tail;
+
+  if (sscanf(spec, "%d%n", &tuning->nice, &tail) < 1 || spec[tail])
+    errx(EXIT_FAILURE, "Invalid nice value");
+  tuning->niced = 1;
+}
+
+static void tune_policy(struct tuning *tuning, char *spec) {
+  static const struct {
+    const char *name;
+    int policy;
+  } policies[] = {
+    { "other", SCHED_OTHER }, { "batch", SCHED_BATCH },
+    { "idle", SCHED_IDLE }, { "fifo", SCHED_FIFO }, { "rr", SCHED_RR }
+  };
+  char *priority;
+  int tail;
+
+  /* Parse POLICY[:PRIORITY], where only fifo and rr take a priority. */
+  if ((priority = strchr(spec, ':')))
+    *priority++ = 0;
+  tuning->policy = -1;
+  for (size_t i = 0; i < sizeof(policies) / sizeof(*policies); i++)
+    if (!strcmp(spec, policies[i].name))
+      tuning->policy = policies[i].policy;
+  tuning->priority = tuning->policy == SCHED_FIFO
+    || tuning->policy == SCHED_RR;
+  if (priority && (sscanf(priority, "%d%n", &tuning->priority, &tail) < 1
+        || priority[tail]))
+    tuning->policy = -1;
+  if (priority)
+    priority[-1] = ':';
+  if (tuning->policy < 0)
+    errx(EXIT_FAILURE, "Invalid scheduling policy");
+}
+
+static void tune(struct tuning *tuning, int option, char *spec) {
+  switch (option) {
+    case 'C':
+      tune_cpus(tuning, spec);
+      break;
+    case 'I':
+      tune_ioprio(tuning, spec);
+      break;
+    case 'L':
+      tune_limit(tuning, spec);
+      break;
+    case 'N':
+      tune_nice(tuning, spec);
+      break;
+    case 'S':
+      tune_policy(tuning, spec);
+      break;
+  }
+}
+
+static const char *tune_apply(void) {
+  struct sched_param param = { .sched_priority = tuning.priority };
+
+  /* Return the name of any call that fails, so vfork children can report
+     it without running atexit() handlers. */
+  if (tuning.affinity)
+    if (sched_setaffinity(0, sizeof(tuning.cpus), &tuning.cpus) < 0)
+      return "sched_setaffinity";
+  if (tuning.policy >= 0 && sched_setscheduler(0, tuning.policy, &param) < 0)
+    return "sched_setscheduler";
+  if (tuning.niced && setpriority(PRIO_PROCESS, 0, tuning.nice) < 0)
+    return "setpriority";
+  if (tuning.ioprio >= 0 && syscall(__NR_ioprio_set, 1, 0, tuning.ioprio) < 0)
+    return "ioprio_set";
+  for (int i = 0; i < RLIM_NLIMITS; i++)
+    if (tuning.resources & 1 << i && setrlimit(i, tuning.limits + i) < 0)
+      return "setrlimit";
+  return NULL;
+}
+
+static int cgroup_write(int dir, const char *key, const char *value) {
+  int fd, status;
+
+  if ((fd = openat(dir, key, O_WRONLY | O_CLOEXEC)) < 0)
+    return -1;
+  status = write(fd, value, strlen(value));
+  close(fd);
+  return status < 0 ? -1 : 0;
+}
+
+static int cgroup_open(const char *name) {
+  char path[PATH_MAX], *cursor;
+  int fd;
+
+  /* Relative names are taken from the root of the cgroup2 hierarchy. */
+  if (snprintf(path, sizeof(path), "%s%s", *name == '/' ? "" :
+        "/sys/fs/cgroup/", name) >= (int) sizeof(path))
+    errx(EXIT_FAILURE, "%s: Path too long", name);
+
+  /* Create any missing cgroups along the path, like mkdir -p. */
+  for (cursor = path; (cursor = strchr(cursor + 1, '/')); *cursor = '/') {
+    *cursor = 0;
+    if (mkdir(path, 0755) < 0 && errno != EEXIST)
+      err(EXIT_FAILURE, "mkdir %s", path);
+  }
+  if (mkdir(path, 0755) < 0 && errno != EEXIST)
+    err(EXIT_FAILURE, "mkdir %s", path);
+
+  if ((fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+    err(EXIT_FAILURE, "%s", path);
+  return fd;
+}
+
+static void cgroup_set(int dir, char *setting) {
+  char *controller, *value;
+
+  if (!(value = strchr(setting, '=')) || value == setting)
+    errx(EXIT_FAILURE, "Invalid cgroup setting: %s", setting);
+  *value++ = 0;
+
+  /* Enable the controller in the parent, ignoring errors if we can't. */
+  if (asprintf(&controller, "+%.*s", (int) strcspn(setting, "."),
+        setting) < 0)
+    err(EXIT_FAILURE, "asprintf");
+  if (strcmp(controller, "+cgroup"))
+    cgroup_write(dir, "../cgroup.subtree_control", controller);
+  free(controller);
+
+  if (cgroup_write(dir, setting, value) < 0)
+    err(EXIT_FAILURE, "%s", setting);
+  value[-1] = '=';
+}
+
+static void cgroup_kill(int dir) {
+  FILE *procs;
+  int fd;
+  pid_t pid;
+
+  /* Kernels before 5.14 lack cgroup.kill, so kill each process instead. */
+  if (dir < 0 || cgroup_write(dir, "cgroup.kill", "1") == 0)
+    return;
+  if ((fd = openat(dir, "cgroup.procs", O_RDONLY | O_CLOEXEC)) < 0)
+    return;
+  if ((procs = fdopen(fd, "r"))) {
+    while (fscanf(procs, "%d", &pid) == 1)
+      kill(pid, SIGKILL);
+    fclose(procs);
   }
+}
+
+static pid_t spawn(int dir) {
+  struct clone_args args = {
+    .flags = CLONE_INTO_CGROUP,
+    .exit_signal = SIGCHLD,
+    .cgroup = dir
+  };
+  pid_t pid;
 
-out:
-  inotify_rm_watch(inotify, watch);
+  /* Start the child directly inside its cgroup with clone3(). */
+  if (dir < 0)
+    return fork();
+  if ((pid = syscall(__NR_clone3, &args, sizeof(args))) >= 0)
+    return pid;
+  if (errno != ENOSYS && errno != E2BIG && errno != EINVAL)
+    return -1;
+
+  /* Without CLONE_INTO_CGROUP, the child moves itself after fork(). */
+  if ((pid = fork()) == 0)
+    if (cgroup_write(dir, "cgroup.procs", "0") < 0)
+      err(EXIT_FAILURE, "cgroup.procs");
+  return pid;
 }
 
 static void listen_add(int fd) {
@@ -129,368 +599,2053 @@ static void listen_add(int fd) {
     pollfd = realloc(pollfd, (listeners + 16) * sizeof(struct pollfd));
     if (pollfd == NULL)
       err(EXIT_FAILURE, "realloc");
+    owners = realloc(owners, (listeners + 16) * sizeof(size_t));
+    if (owners == NULL)
+      err(EXIT_FAILURE, "realloc");
   }
+  owners[listeners] = 0;
   pollfd[listeners++].fd = fd;
 }
 
+static void listen_steer(int fd) {
+  struct sock_filter code[] = {
+    { BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU },
+    { BPF_ALU | BPF_MOD | BPF_K, 0, 0, shards },
+    { BPF_RET | BPF_A, 0, 0, 0 }
+  };
+  struct sock_fprog program = { sizeof(code) / sizeof(*code), code };
+
+  /* Pick the socket in the reuseport group whose index matches the CPU
+     handling the incoming SYN, so the shard pinned there accepts it. */
+  if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &program,
+        sizeof(program)) < 0)
+    err(EXIT_FAILURE, "SO_ATTACH_REUSEPORT_CBPF");
+}
+
 static void listen_tcp(const char *address) {
   struct addrinfo hints = { .ai_socktype = SOCK_STREAM }, *info, *list;
   char host[256], port[32];
   int fd, status, tail;
 
-  if (sscanf(address, "[%255[^]]]:%31[^:]%n", host, port, &tail) < 2) {
-    if (sscanf(address, "%255[^:]:%31[^:]%n", host, port, &tail) < 2) {
-      if (sscanf(address, ":%31[^:]%n", port, &tail) < 1)
-        errx(EXIT_FAILURE, "%s: Invalid address", address);
-      snprintf(host, sizeof(host), "::");
-    }
+  if (sscanf(address, "[%255[^]]]:%31[^:]%n", host, port, &tail) < 2) {
+    if (sscanf(address, "%255[^:]:%31[^:]%n", host, port, &tail) < 2) {
+      if (sscanf(address, ":%31[^:]%n", port, &tail) < 1)
+        errx(EXIT_FAILURE, "%s: Invalid address", address);
+      snprintf(host, sizeof(host), "::");
+    }
+  }
+
+  if (address[tail] != 0)
+    errx(EXIT_FAILURE, "%s: Invalid address", address);
+
+  if ((status = getaddrinfo(host, port, &hints, &list)) != 0)
+    errx(EXIT_FAILURE, "getaddrinfo: %s", gai_strerror(status));
+
+  /* With -j, each address gets one SO_REUSEPORT socket per shard. */
+  for (info = list; info != NULL; info = info->ai_next)
+    for (size_t shard = 0; shard < shards; shard++) {
+      if ((fd = socket(info->ai_family, info->ai_socktype, 0)) < 0)
+        err(EXIT_FAILURE, "socket");
+      setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &(int) { 1 }, sizeof(int));
+      fcntl(fd, F_SETFD, FD_CLOEXEC);
+      fcntl(fd, F_SETFL, O_NONBLOCK);
+
+      if (shards > 1 && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT,
+            &(int) { 1 }, sizeof(int)) < 0)
+        err(EXIT_FAILURE, "SO_REUSEPORT");
+      if (steer && shard == 0)
+        listen_steer(fd);
+      if (bind(fd, info->ai_addr, info->ai_addrlen) < 0)
+        err(EXIT_FAILURE, "bind");
+      if (listen(fd, SOMAXCONN) < 0)
+        err(EXIT_FAILURE, "listen");
+      listen_add(fd);
+      owners[listeners - 1] = shard;
+    }
+}
+
+static void listen_unix(const char *path) {
+  struct sockaddr_un address;
+  size_t length = strlen(path);
+  int fd;
+
+  /* On Linux, address.sun_path is NUL-padded not NUL-terminated. */
+  if (length > sizeof(address.sun_path))
+    errx(EXIT_FAILURE, "Socket path is too long to bind");
+  length += offsetof(struct sockaddr_un, sun_path);
+
+  address.sun_family = AF_UNIX;
+  strncpy(address.sun_path, path, sizeof(address.sun_path));
+  unlink(path);
+
+  if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+    err(EXIT_FAILURE, "socket");
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+  fcntl(fd, F_SETFL, O_NONBLOCK);
+
+  if (bind(fd, (struct sockaddr *) &address, length) < 0)
+    err(EXIT_FAILURE, "bind");
+  if (listen(fd, SOMAXCONN) < 0)
+    err(EXIT_FAILURE, "listen");
+  listen_add(fd);
+}
+
+static int listen_clear(int fd) {
+  int moved;
+
+  /* Move a live fd above the range about to be taken by the listeners. */
+  if (fd < 3 || fd >= 3 + (int) listeners)
+    return fd;
+  moved = fcntl(fd, fcntl(fd, F_GETFD) & FD_CLOEXEC ? F_DUPFD_CLOEXEC
+    : F_DUPFD, 3 + listeners);
+  if (moved < 0)
+    err(EXIT_FAILURE, "fcntl");
+  close(fd);
+  return moved;
+}
+
+static void listen_pass(void) {
+  char value[32];
+  int fd;
+
+  /* Keep the pidfile lock and the timeline clear of the listeners, and
+     send our last warnings to fd 2 as the command will. */
+  if (pidfile.path)
+    pidfile.fd = listen_clear(pidfile.fd);
+  if (timeline.fd >= 0)
+    timeline.fd = listen_clear(timeline.fd);
+  if (console)
+    stderr = console;
+
+  /* Move the listeners to fds 3 and up for sd_listen_fds(), clearing
+     O_NONBLOCK as the command will accept() on them itself. */
+  for (size_t i = 0; i < listeners; i++) {
+    fd = fcntl(pollfd[i].fd, F_DUPFD_CLOEXEC, 3 + listeners);
+    if (fd < 0)
+      err(EXIT_FAILURE, "fcntl");
+    pollfd[i].fd = fd;
+  }
+  for (size_t i = 0; i < listeners; i++) {
+    if (dup2(pollfd[i].fd, 3 + i) < 0)
+      err(EXIT_FAILURE, "dup2");
+    fcntl(3 + i, F_SETFL, fcntl(3 + i, F_GETFL) & ~O_NONBLOCK);
+  }
+
+  snprintf(value, sizeof(value), "%zu", listeners);
+  setenv("LISTEN_FDS", value, 1);
+  snprintf(value, sizeof(value), "%d", getpid());
+  setenv("LISTEN_PID", value, 1);
+}
+
+static int logger_code(const char *name, const CODE *codes, int shift) {
+  char *end;
+  long value;
+
+  /* Accept symbolic names as for logger(1), or plain numbers. */
+  value = strtol(name, &end, 10);
+  if (*name && !*end)
+    return value >= 0 && value < (shift ? LOG_NFACILITIES : 8)
+      ? value << shift : -1;
+  for (size_t i = 0; codes[i].c_name; i++)
+    if (!strcmp(codes[i].c_name, name))
+      return codes[i].c_val;
+  return -1;
+}
+
+static void logger_setup(struct logger *log, const char *spec) {
+  char *priority;
+  int facility = LOG_DAEMON, level = LOG_NOTICE;
+
+  if (log->tag)
+    errx(EXIT_FAILURE, "-l cannot be specified more than once");
+  if (!*spec || *spec == ':')
+    errx(EXIT_FAILURE, "Invalid or missing syslog identifier tag");
+  if (!(log->tag = strdup(spec)))
+    err(EXIT_FAILURE, "strdup");
+
+  /* Logging to file indicated by absolute path. */
+  if (*log->tag == '/') {
+    log->file = open(log->tag, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0666);
+    if (log->file < 0)
+      err(EXIT_FAILURE, "%s", log->tag);
+    if (flock(log->file, LOCK_EX | LOCK_NB) < 0)
+      errx(EXIT_FAILURE, "%s already locked", log->tag);
+    return;
+  }
+
+  /* Log spec format is TAG:PRIORITY, where PRIORITY is [FACILITY.]LEVEL. */
+  if ((priority = strchr(log->tag, ':'))) {
+    *priority++ = 0;
+    if (*priority) {
+      facility = LOG_USER;
+      if (strchr(priority, '.'))
+        facility = logger_code(strsep(&priority, "."), facilitynames, 3);
+      level = logger_code(priority, prioritynames, 0);
+      if (facility < 0 || facility > LOG_LOCAL7 || level < 0
+          || level > LOG_DEBUG)
+        errx(EXIT_FAILURE, "Invalid syslog priority");
+    }
+  }
+
+  if (asprintf(&log->header, "<%d>%s: ", facility | level, log->tag) < 0)
+    err(EXIT_FAILURE, "asprintf");
+}
+
+static void logger_limit(struct logger *log, char *spec) {
+  char *end;
+
+  /* Parse SIZE[:COUNT], allowing a k, M or G suffix on the SIZE. */
+  log->limit = strtoul(spec, &end, 10);
+  switch (end > spec ? *end : 0) {
+    case 'G':
+    case 'g':
+      log->limit <<= 10;
+      /* Fall through to scale by another factor of 1024. */
+    case 'M':
+    case 'm':
+      log->limit <<= 10;
+      /* Fall through to scale by another factor of 1024. */
+    case 'K':
+    case 'k':
+      log->limit <<= 10;
+      end++;
+  }
+  log->keep = 1;
+  if (end > spec && *end == ':')
+    log->keep = strtoul(spec = end + 1, &end, 10);
+  if (end == spec || *end || !(*spec >= '0' && *spec <= '9'))
+    errx(EXIT_FAILURE, "Invalid log size limit");
+
+  if (!log->output && !(log->output = malloc(LOG_OUTPUT)))
+    err(EXIT_FAILURE, "malloc");
+}
+
+static void logger_reopen(struct logger *log) {
+  struct stat status;
+  int fd;
+
+  /* Open the log file afresh, after rotation or on SIGHUP. */
+  fd = open(log->tag, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0666);
+  if (fd < 0) {
+    warn("%s", log->tag);
+    return;
+  }
+  flock(fd, LOCK_EX | LOCK_NB);
+  close(log->file);
+  log->file = fd;
+  log->written = fstat(fd, &status) < 0 ? 0 : status.st_size;
+}
+
+static void logger_rotate(struct logger *log) {
+  char from[PATH_MAX], to[PATH_MAX];
+
+  /* Shift LOGFILE.N-1 to LOGFILE.N, ..., then LOGFILE to LOGFILE.1. */
+  if (log->keep == 0 && ftruncate(log->file, 0) >= 0) {
+    log->written = 0;
+    return;
+  }
+  for (size_t i = log->keep; i > 0; i--) {
+    snprintf(to, sizeof(to), "%s.%zu", log->tag, i);
+    if (i > 1)
+      snprintf(from, sizeof(from), "%s.%zu", log->tag, i - 1);
+    else
+      snprintf(from, sizeof(from), "%s", log->tag);
+    if (rename(from, to) < 0 && errno != ENOENT)
+      warn("rename %s", from);
+  }
+  logger_reopen(log);
+}
+
+static void logger_write(struct logger *log) {
+  ssize_t count;
+  size_t done = 0;
+
+  /* Rotate first if this batch would take the file past its limit. */
+  if (log->limit && log->written > 0)
+    if (log->written + log->used > log->limit)
+      logger_rotate(log);
+
+  while (done < log->used) {
+    if ((count = write(log->file, log->output + done, log->used - done)) < 0)
+      if (errno == EINTR)
+        continue;
+    if (count <= 0)
+      break;
+    done += count;
+  }
+  log->written += done;
+  log->used = 0;
+}
+
+static void logger_flush(void) {
+  struct sockaddr_un address = {
+    .sun_family = AF_UNIX,
+    .sun_path = "/dev/log"
+  };
+  size_t sent = 0;
+  int count, retry = 1;
+
+  while (sent < syslogs.count) {
+    if (syslogs.fd < 0) {
+      syslogs.fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+      if (syslogs.fd < 0)
+        break;
+      if (connect(syslogs.fd, (struct sockaddr *) &address,
+            sizeof(address)) < 0) {
+        close(syslogs.fd);
+        syslogs.fd = -1;
+        break;
+      }
+    }
+
+    count = sendmmsg(syslogs.fd, syslogs.messages + sent,
+      syslogs.count - sent, 0);
+    if (count > 0) {
+      sent += count;
+    } else if (errno != EINTR) {
+      /* Reconnect once in case syslogd restarted, else drop the batch. */
+      close(syslogs.fd);
+      syslogs.fd = -1;
+      if (retry-- == 0)
+        break;
+    }
+  }
+  syslogs.count = 0;
+}
+
+static void logger_append(struct logger *log, char *stamp, char *line,
+    size_t length) {
+  size_t size = strlen(stamp), total = size + length + 1;
+
+  /* Write out before the buffer fills or the file would pass its limit. */
+  if (log->used + total > LOG_OUTPUT)
+    logger_write(log);
+  else if (log->limit && log->written + log->used + total > log->limit)
+    logger_write(log);
+  memcpy(log->output + log->used, stamp, size);
+  memcpy(log->output + log->used + size, line, length);
+  log->used += size + length;
+  log->output[log->used++] = '\n';
+}
+
+static void logger_send(struct logger *log, char *line, size_t length) {
+  struct iovec *vector;
+
+  if (length == 0)
+    return;
+  if (syslogs.count == LOG_BATCH)
+    logger_flush();
+
+  vector = syslogs.vectors[syslogs.count];
+  vector[0] = (struct iovec) { log->header, strlen(log->header) };
+  vector[1] = (struct iovec) { line, length };
+  syslogs.messages[syslogs.count++].msg_hdr = (struct msghdr) {
+    .msg_iov = vector, .msg_iovlen = 2
+  };
+}
+
+static ssize_t logger_read(struct logger *log) {
+  char *cursor, *end, *line, stamp[32];
+  struct timespec now;
+  struct tm date;
+  ssize_t count;
+
+  /* Return the bytes read, 0 at EOF and -1 if interrupted or empty. */
+  if ((count = read(log->pipe[0], log->buffer + log->length,
+      LOG_BUFFER - log->length)) < 0)
+    return errno == EAGAIN || errno == EINTR ? -1 : 0;
+
+  /* Lines arriving in the same read share a single UTC timestamp. */
+  if (log->output) {
+    clock_gettime(CLOCK_REALTIME, &now);
+    gmtime_r(&now.tv_sec, &date);
+    snprintf(stamp, sizeof(stamp), "%04u-%02u-%02u %02u:%02u:%02u.%06u ",
+      date.tm_year + 1900, date.tm_mon + 1, date.tm_mday, date.tm_hour,
+      date.tm_min, date.tm_sec, (unsigned) now.tv_nsec / 1000);
+  }
+
+  /* Send each complete line, splitting any longer than LOG_LINE. */
+  end = log->buffer + log->length + count;
+  for (cursor = line = log->buffer; cursor < end; cursor++)
+    if (*cursor == '\n' || cursor - line == LOG_LINE) {
+      if (log->output)
+        logger_append(log, stamp, line, cursor - line);
+      else
+        logger_send(log, line, cursor - line);
+      line = *cursor == '\n' ? cursor + 1 : cursor;
+    }
+
+  /* A partial line is held back for more input unless at EOF. */
+  if (count == 0 && end > line) {
+    if (log->output)
+      logger_append(log, stamp, line, end - line);
+    else
+      logger_send(log, line, end - line);
+  }
+  if (log->output)
+    logger_write(log);
+  else
+    logger_flush();
+
+  log->length = count > 0 ? end - line : 0;
+  memmove(log->buffer, line, log->length);
+  return count;
+}
+
+static void logger_drain(void) {
+  /* Pass on anything still sitting in the log pipes before exiting. */
+  if (getpid() != syslogs.owner)
+    return;
+  while (logger.pipe[0] >= 0 && logger_read(&logger) > 0)
+    continue;
+  for (size_t i = 0; i < managed; i++)
+    while (services[i].log.pipe[0] >= 0 && logger_read(&services[i].log) > 0)
+      continue;
+}
+
+static void logger_hangup(int signal) {
+  hangup = 1;
+}
+
+static void logger_pipe(struct logger *log) {
+  if (!log->buffer && !(log->buffer = malloc(LOG_BUFFER)))
+    err(EXIT_FAILURE, "malloc");
+  if (pipe2(log->pipe, O_CLOEXEC) < 0)
+    err(EXIT_FAILURE, "pipe");
+  fcntl(log->pipe[0], F_SETFL, O_NONBLOCK);
+
+  if (syslogs.owner == 0) {
+    syslogs.owner = getpid();
+    atexit(logger_drain);
+  }
+}
+
+static void logger_redirect(int fd) {
+  if (dup2(fd, STDOUT_FILENO) < 0)
+    err(EXIT_FAILURE, "dup2");
+  if (dup2(fd, STDERR_FILENO) < 0)
+    err(EXIT_FAILURE, "dup2");
+}
+
+static void logger_start(int reader) {
+  char path[64];
+  FILE *stream;
+  int fd;
+
+  /* Redirect stdout and stderr to /dev/null if logging isn't configured. */
+  if (!logger.tag) {
+    logger_redirect(STDIN_FILENO);
+    return;
+  }
+
+  /* Redirect stdout and stderr if a log file has been specified. */
+  if (logger.file >= 0 && !logger.output) {
+    logger_redirect(logger.file);
+    close(logger.file);
+    logger.file = -1;
+    return;
+  }
+
+  /* Without a supervisor loop to read the pipe, fork a minimal reader. */
+  logger_pipe(&logger);
+  if (reader) {
+    switch (fork()) {
+      case -1:
+        err(EXIT_FAILURE, "fork");
+      case 0:
+        if (pidfile.path) {
+          pidfile.path = NULL;
+          close(pidfile.fd);
+        }
+        /* Don't unintentionally keep the pwd busy in the reader process. */
+        if (chdir("/") < 0)
+          err(EXIT_FAILURE, "chdir");
+        logger_redirect(STDIN_FILENO);
+        close(logger.pipe[1]);
+        fcntl(logger.pipe[0], F_SETFL, 0);
+        /* Without SA_RESTART, SIGHUP interrupts read() to reopen a file. */
+        sigaction(SIGHUP, &(struct sigaction) {
+          .sa_handler = logger_hangup
+        }, NULL);
+        while (logger_read(&logger))
+          if (hangup && logger.output) {
+            hangup = 0;
+            logger_reopen(&logger);
+          }
+        _exit(EXIT_SUCCESS);
+    }
+    close(logger.pipe[0]);
+    logger.pipe[0] = -1;
+  }
+
+  /* Redirect our stdout and stderr to the write end of the pipe. */
+  logger_redirect(logger.pipe[1]);
+
+  /* When we drain the pipe ourselves, our own warnings must not block on
+     it if a chatty child fills it. Write them through a separate open of
+     the pipe that is nonblocking, leaving fds 1 and 2 blocking for the
+     commands that inherit them. */
+  snprintf(path, sizeof(path), "/proc/self/fd/%d", logger.pipe[1]);
+  if (!reader && (fd = open(path, O_WRONLY | O_NONBLOCK | O_CLOEXEC)) >= 0) {
+    if ((stream = fdopen(fd, "w"))) {
+      setvbuf(stream, NULL, _IONBF, 0);
+      console = stderr;
+      stderr = stream;
+    } else {
+      close(fd);
+    }
+  }
+  close(logger.pipe[1]);
+  logger.pipe[1] = -1;
+}
+
+static void pidfile_close(void) {
+  if (pidfile.path) {
+    close(pidfile.fd);
+    unlink(pidfile.path);
+  }
+}
+
+static void pidfile_open(const char *path) {
+  char *temp = NULL;
+  int fd;
+
+  /* Awaiting readiness, write PIDFILE.new and rename it once ready.
+     A stale PIDFILE would release -w waiters early, so remove it. */
+  if (notify >= 0) {
+    if ((fd = open(path, O_RDWR)) >= 0) {
+      if (flock(fd, LOCK_EX | LOCK_NB) < 0)
+        errx(EXIT_FAILURE, "%s already locked", path);
+      unlink(path);
+      close(fd);
+    }
+    if (asprintf(&temp, "%s.new", path) < 0)
+      err(EXIT_FAILURE, "asprintf");
+    path = temp;
+  }
+
+  pidfile.fd = open(path, O_RDWR | O_CREAT, 0666);
+  if (pidfile.fd < 0)
+    err(EXIT_FAILURE, "%s", path);
+  if (flock(pidfile.fd, LOCK_EX | LOCK_NB) < 0)
+    errx(EXIT_FAILURE, "%s already locked", path);
+
+  /* Keep the lock clear of the notification fd, which dup2() replaces. */
+  if (pidfile.fd == notify) {
+    if ((fd = fcntl(pidfile.fd, F_DUPFD, notify + 1)) < 0)
+      err(EXIT_FAILURE, "fcntl");
+    close(pidfile.fd);
+    pidfile.fd = fd;
+  }
+  if (!(pidfile.path = realpath(path, NULL)))
+    err(EXIT_FAILURE, "%s", path);
+  if (ftruncate(pidfile.fd, 0) < 0)
+    err(EXIT_FAILURE, "%s", path);
+  atexit(pidfile_close);
+
+  if (temp) {
+    pidfile.ready = strndup(pidfile.path, strlen(pidfile.path) - 4);
+    if (pidfile.ready == NULL)
+      err(EXIT_FAILURE, "strndup");
+    free(temp);
+  }
+}
+
+static void pidfile_ready(void) {
+  if (pidfile.path && pidfile.ready) {
+    if (rename(pidfile.path, pidfile.ready) < 0)
+      err(EXIT_FAILURE, "rename %s", pidfile.path);
+    free(pidfile.path);
+    pidfile.path = pidfile.ready;
+    pidfile.ready = NULL;
+  }
+}
+
+static void pidfile_write(void) {
+  if (pidfile.path && dprintf(pidfile.fd, "%d\n", getpid()) < 0)
+    err(EXIT_FAILURE, "dprintf");
+}
+
+static int notify_read(int fd) {
+  char buffer[256];
+  ssize_t count;
+
+  /* Return 1 once a newline arrives, -1 at EOF and 0 otherwise. */
+  while ((count = read(fd, buffer, sizeof(buffer))) < 0)
+    if (errno != EINTR)
+      return errno == EAGAIN ? 0 : -1;
+  if (count == 0)
+    return -1;
+  return memchr(buffer, '\n', count) != NULL;
+}
+
+static int notify_start(int fds[2]) {
+  if (pipe2(fds, O_CLOEXEC) < 0)
+    err(EXIT_FAILURE, "pipe");
+  return fds[0];
+}
+
+static void notify_child(int fds[2]) {
+  /* Give the command the write end of the pipe as its notification fd. */
+  close(fds[0]);
+  if (fds[1] != notify) {
+    if (dup2(fds[1], notify) < 0)
+      err(EXIT_FAILURE, "dup2");
+    close(fds[1]);
+  } else {
+    fcntl(notify, F_SETFD, 0);
+  }
+}
+
+static void notify_helper(void) {
+  int fds[2], status;
+  pid_t pid;
+
+  notify_start(fds);
+  switch (pid = fork()) {
+    case -1:
+      err(EXIT_FAILURE, "fork");
+    case 0:
+      /* Fork again so the helper isn't left as a zombie of the command. */
+      if (fork() != 0)
+        _exit(EXIT_SUCCESS);
+      close(pidfile.fd);
+      close(fds[1]);
+      while ((status = notify_read(fds[0])) == 0)
+        continue;
+      if (status > 0 && rename(pidfile.path, pidfile.ready) >= 0)
+        _exit(EXIT_SUCCESS);
+      unlink(pidfile.path);
+      _exit(EXIT_FAILURE);
+  }
+
+  if (waitpid(pid, NULL, 0) < 0)
+    err(EXIT_FAILURE, "waitpid");
+  notify_child(fds);
+}
+
+static pid_t reap(int *status) {
+  pid_t child;
+
+  while ((child = waitpid(-1, status, WNOHANG)) < 0)
+    if (errno != EINTR)
+      break;
+  return child > 0 ? child : 0;
+}
+
+static int signal_get(void) {
+  unsigned char signal = 0;
+  while (read(signals[0], &signal, 1) < 0)
+    if (errno != EINTR)
+      break;
+  return signal;
+}
+
+static void signal_put(int signal) {
+  while (write(signals[1], &(unsigned char) { signal }, 1) < 0)
+    if (errno != EINTR)
+      break;
+}
+
+static const char *prepare(char **argv, char **env) {
+  const char *call;
+
+  if ((call = tune_apply()))
+    return call;
+  if (gid > 0 && setgid(gid) < 0)
+    return "setgid";
+  if (uid > 0 && setuid(uid) < 0)
+    return "setuid";
+  execvpe(argv[0], argv, env);
+  return "exec";
+}
+
+static void execute(char **argv) {
+  err(EXIT_FAILURE, "%s", prepare(argv, environ));
+}
+
+struct handler {
+  char **argv, **env;
+  int connection;
+  sigset_t mask;
+};
+
+static int handler_exec(void *data) {
+  static const int caught[] = {
+    SIGHUP, SIGINT, SIGPIPE, SIGTERM, SIGCHLD, SIGUSR1, SIGUSR2
+  };
+  struct handler *handler = data;
+  const char *call;
+
+  /* We share the parent's memory until exec, so only make syscalls here
+     and never return or exit() through its atexit() handlers. */
+  for (size_t i = 0; i < sizeof(caught) / sizeof(*caught); i++)
+    signal(caught[i], SIG_DFL);
+  sigprocmask(SIG_SETMASK, &handler->mask, NULL);
+
+  if (pidfile.path)
+    close(pidfile.fd);
+  if (cgroup >= 0 && cgroup_write(cgroup, "cgroup.procs", "0") < 0)
+    call = "cgroup.procs";
+  else if (dup2(handler->connection, STDIN_FILENO) < 0)
+    call = "dup2";
+  else if (dup2(handler->connection, STDOUT_FILENO) < 0)
+    call = "dup2";
+  else {
+    close(handler->connection);
+    call = prepare(handler->argv, handler->env);
+  }
+  dprintf(STDERR_FILENO, "%s: %s: %s\n", program_invocation_short_name,
+    call, strerror(errno));
+  _exit(EXIT_FAILURE);
+}
+
+static pid_t handler_spawn(char **argv, char **env, int connection) {
+  static char *stack;
+  struct handler handler = {
+    .argv = argv, .env = env, .connection = connection
+  };
+  sigset_t all;
+  pid_t pid;
+
+  /* The parent is suspended until exec, so one stack serves every child. */
+  if (!stack) {
+    stack = mmap(NULL, SPAWN_STACK, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+    if (stack == MAP_FAILED) {
+      stack = NULL;
+      return -1;
+    }
+  }
+
+  /* Block signals so no handler runs in the child on our memory. */
+  sigfillset(&all);
+  sigprocmask(SIG_SETMASK, &all, &handler.mask);
+  pid = clone(handler_exec, stack + SPAWN_STACK,
+    CLONE_VM | CLONE_VFORK | SIGCHLD, &handler);
+  sigprocmask(SIG_SETMASK, &handler.mask, NULL);
+  return pid;
+}
+
+static void statusfile_close(void) {
+  if (statusfile.path && statusfile.owner == getpid())
+    unlink(statusfile.path);
+}
+
+static void statusfile_open(const char *path) {
+  char *cwd = NULL;
+  int fd;
+
+  /* Resolve the path now as we may chdir() before writing to it. */
+  if (*path != '/' && !(cwd = getcwd(NULL, 0)))
+    err(EXIT_FAILURE, "getcwd");
+  if (asprintf(&statusfile.path, "%s%s%s", cwd ? cwd : "", cwd ? "/" : "",
+        path) < 0)
+    err(EXIT_FAILURE, "asprintf");
+  if (asprintf(&statusfile.temp, "%s.new", statusfile.path) < 0)
+    err(EXIT_FAILURE, "asprintf");
+  free(cwd);
+
+  /* Check we can write next to it while still in the foreground. */
+  if ((fd = open(statusfile.temp, O_WRONLY | O_CREAT, 0644)) < 0)
+    err(EXIT_FAILURE, "%s", statusfile.temp);
+  close(fd);
+  unlink(statusfile.temp);
+  atexit(statusfile_close);
+}
+
+static void statusfile_write(void) {
+  char text[sizeof(statusfile.text)];
+  struct stats total = { 0 };
+  int fd, length;
+
+  if (!statusfile.path)
+    return;
+  statusfile.due = 0;
+  statusfile.written = monotonic();
+
+  length = snprintf(text, sizeof(text), "pid=%d\nstarted=%lld\n",
+    getpid(), (long long) statusfile.started);
+  if (stats) {
+    /* Shards each count in their own slot of a shared mapping. */
+    for (size_t i = 0; i < shards; i++) {
+      total.accepted += stats[i].accepted;
+      total.active += stats[i].active;
+      total.expired += stats[i].expired;
+      total.refused += stats[i].refused;
+    }
+    snprintf(text + length, sizeof(text) - length,
+      "active=%zu\naccepted=%zu\nrefused=%zu\nexpired=%zu\n",
+      total.active, total.accepted, total.refused, total.expired);
+  } else {
+    length += snprintf(text + length, sizeof(text) - length,
+      "child=%d\nsince=%lld\nrestarts=%lu\n", statusfile.child,
+      (long long) statusfile.since, statusfile.restarts);
+    if (statusfile.status >= 0 && WIFSIGNALED(statusfile.status))
+      snprintf(text + length, sizeof(text) - length, "signal=%d\n",
+        WTERMSIG(statusfile.status));
+    else if (statusfile.status >= 0)
+      snprintf(text + length, sizeof(text) - length, "exit=%d\n",
+        WEXITSTATUS(statusfile.status));
+  }
+
+  /* Replace the file atomically, and only when something changed. */
+  if (strcmp(text, statusfile.text) == 0)
+    return;
+  fd = open(statusfile.temp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0)
+    return;
+  length = strlen(text);
+  if (write(fd, text, length) != length)
+    length = -1;
+  if (close(fd) < 0 || length < 0
+      || rename(statusfile.temp, statusfile.path) < 0)
+    unlink(statusfile.temp);
+  else
+    strcpy(statusfile.text, text);
+}
+
+static void statusfile_dirty(void) {
+  /* Batch updates from busy services to one write per interval. */
+  if (statusfile.path && statusfile.due == 0)
+    statusfile.due = statusfile.written + STATUS_INTERVAL;
+}
+
+static void peer_setup(void) {
+  static const char *names[] = { "PROTO=", "TCPLOCAL", "TCPREMOTE",
+    "UNIXREMOTE" };
+  size_t count = 0;
+
+  /* Copy the environment once, leaving room for the peer variables. The
+     vfork-style child must not call setenv() in our shared memory. */
+  while (environ[count])
+    count++;
+  if (!(peer.env = malloc((count + PEER_VARS + 1) * sizeof(char *))))
+    err(EXIT_FAILURE, "malloc");
+  for (size_t i = 0; i < count; i++) {
+    for (size_t j = 0; j < sizeof(names) / sizeof(*names); j++)
+      if (strncmp(environ[i], names[j], strlen(names[j])) == 0)
+        goto skip;
+    peer.env[peer.base++] = environ[i];
+  skip:;
+  }
+  peer.env[peer.base] = NULL;
+}
+
+static unsigned peer_host(struct sockaddr_storage *address, char *host) {
+  struct sockaddr_in *in = (struct sockaddr_in *) address;
+  struct sockaddr_in6 *in6 = (struct sockaddr_in6 *) address;
+
+  /* Report IPv4 clients of a dual-stack listener in IPv4 form. */
+  if (address->ss_family == AF_INET) {
+    inet_ntop(AF_INET, &in->sin_addr, host, INET6_ADDRSTRLEN);
+    return ntohs(in->sin_port);
+  }
+  if (IN6_IS_ADDR_V4MAPPED(&in6->sin6_addr))
+    inet_ntop(AF_INET, in6->sin6_addr.s6_addr + 12, host, INET6_ADDRSTRLEN);
+  else
+    inet_ntop(AF_INET6, &in6->sin6_addr, host, INET6_ADDRSTRLEN);
+  return ntohs(in6->sin6_port);
+}
+
+static void peer_set(int connection, struct sockaddr_storage *remote) {
+  struct sockaddr_storage local;
+  struct ucred peercred = { 0, -1, -1 };
+  socklen_t length;
+  char host[INET6_ADDRSTRLEN];
+  size_t count = 2;
+  unsigned port;
+
+  /* Set variables as ucspi-tcp and ucspi-unix do, and identify the
+     source by address for TCP and by uid for unix sockets. */
+  if (remote->ss_family == AF_UNIX) {
+    length = sizeof(peercred);
+    getsockopt(connection, SOL_SOCKET, SO_PEERCRED, &peercred, &length);
+    snprintf(peer.source, sizeof(peer.source), "%d", (int) peercred.uid);
+    snprintf(peer.vars[0], sizeof(*peer.vars), "PROTO=UNIX");
+    snprintf(peer.vars[1], sizeof(*peer.vars), "UNIXREMOTEUID=%d",
+      (int) peercred.uid);
+    if (peercred.pid > 0) {
+      snprintf(peer.vars[count++], sizeof(*peer.vars), "UNIXREMOTEGID=%d",
+        (int) peercred.gid);
+      snprintf(peer.vars[count++], sizeof(*peer.vars), "UNIXREMOTEPID=%d",
+        (int) peercred.pid);
+    }
+  } else {
+    port = peer_host(remote, peer.source);
+    snprintf(peer.vars[0], sizeof(*peer.vars), "PROTO=TCP");
+    snprintf(peer.vars[1], sizeof(*peer.vars), "TCPREMOTEIP=%s",
+      peer.source);
+    snprintf(peer.vars[count++], sizeof(*peer.vars), "TCPREMOTEPORT=%u",
+      port);
+    length = sizeof(local);
+    if (getsockname(connection, (struct sockaddr *) &local, &length) == 0) {
+      port = peer_host(&local, host);
+      snprintf(peer.vars[count++], sizeof(*peer.vars), "TCPLOCALIP=%s",
+        host);
+      snprintf(peer.vars[count++], sizeof(*peer.vars), "TCPLOCALPORT=%u",
+        port);
+    }
+  }
+
+  for (size_t i = 0; i < count; i++)
+    peer.env[peer.base + i] = peer.vars[i];
+  peer.env[peer.base + count] = NULL;
+}
+
+static size_t client_count(const char *source) {
+  size_t count = 0;
+
+  for (size_t i = 0; i < clients_size; i++)
+    if (clients[i].pid > 0)
+      count += strcmp(clients[i].source, source) == 0;
+  return count;
+}
+
+static size_t client_add(pid_t pid, const char *source, int connection,
+    double now) {
+  size_t slot = 0;
+
+  /* Slots never move, so a slot number can tag epoll events. */
+  while (slot < clients_size && clients[slot].pid > 0)
+    slot++;
+  if (slot == clients_size) {
+    clients_size = clients_size ? 2 * clients_size : 16;
+    clients = realloc(clients, clients_size * sizeof(struct client));
+    if (clients == NULL)
+      err(EXIT_FAILURE, "realloc");
+    for (size_t i = slot; i < clients_size; i++)
+      clients[i].pid = 0;
+  }
+
+  clients[slot] = (struct client) {
+    .active = now, .started = now, .fd = -1, .pid = pid
+  };
+  strcpy(clients[slot].source, source);
+
+  /* Keep a reference to watch for activity and to cut off the client. */
+  if (expiry.life > 0 || expiry.idle > 0)
+    clients[slot].fd = fcntl(connection, F_DUPFD_CLOEXEC, 0);
+  return slot;
+}
+
+static double client_deadline(struct client *client) {
+  double life = client->started + expiry.life;
+  double idle = client->active + expiry.idle;
+
+  if (expiry.life > 0 && (expiry.idle <= 0 || life < idle))
+    return life;
+  return expiry.idle > 0 ? idle : 0;
+}
+
+static double client_expire(double now) {
+  struct tcp_info info;
+  socklen_t length;
+  double deadline, next = 0;
+
+  for (size_t i = 0; i < clients_size; i++) {
+    if (clients[i].pid <= 0 || clients[i].expired)
+      continue;
+
+    /* Epoll only sees inbound data, so ask TCP when we last sent any. */
+    length = sizeof(info);
+    if (expiry.idle > 0 && getsockopt(clients[i].fd, IPPROTO_TCP, TCP_INFO,
+          &info, &length) == 0)
+      if (now - info.tcpi_last_data_sent / 1e3 > clients[i].active)
+        clients[i].active = now - info.tcpi_last_data_sent / 1e3;
+
+    if ((deadline = client_deadline(&clients[i])) > now) {
+      if (next == 0 || deadline < next)
+        next = deadline;
+    } else {
+      kill(clients[i].pid, SIGKILL);
+      shutdown(clients[i].fd, SHUT_RDWR);
+      clients[i].expired = 1;
+      stats->expired++;
+      statusfile_dirty();
+    }
+  }
+  return next;
+}
+
+static void client_remove(int epoll, pid_t pid) {
+  for (size_t i = 0; i < clients_size; i++)
+    if (clients[i].pid == pid) {
+      /* A grandchild may still hold the connection, which would keep the
+         registration alive and tag its events with a reused slot. */
+      if (clients[i].fd >= 0) {
+        epoll_ctl(epoll, EPOLL_CTL_DEL, clients[i].fd, NULL);
+        close(clients[i].fd);
+      }
+      clients[i].pid = 0;
+      break;
+    }
+}
+
+static void serve_watch(int epoll, int op, int fd, uint32_t events,
+    size_t tag) {
+  struct epoll_event event = { .events = events, .data.u64 = tag };
+
+  if (fd >= 0 && epoll_ctl(epoll, op, fd, &event) < 0)
+    err(EXIT_FAILURE, "epoll_ctl");
+}
+
+static int serve(char **argv, size_t limit, size_t persource) {
+  struct epoll_event events[SERVE_EVENTS];
+  struct sockaddr_storage address;
+  socklen_t length;
+  double deadline, next = 0, now;
+  int connection, epoll, failing = 0, paused = 0, ready, timeout;
+  size_t slot, tag;
+  pid_t child;
+
+  /* Tag each listener by index, then signals, then our own log pipe,
+     then the connections we watch for activity by slot. */
+  if ((epoll = epoll_create1(EPOLL_CLOEXEC)) < 0)
+    err(EXIT_FAILURE, "epoll_create1");
+  for (size_t i = 0; i < listeners; i++)
+    serve_watch(epoll, EPOLL_CTL_ADD, pollfd[i].fd, EPOLLIN, i);
+  serve_watch(epoll, EPOLL_CTL_ADD, signals[0], EPOLLIN, listeners);
+  serve_watch(epoll, EPOLL_CTL_ADD, logger.pipe[0], EPOLLIN, listeners + 1);
+  peer_setup();
+
+  while (1) {
+    /* Only listen for new connections when below the connection limit. */
+    if (paused != (stats->active >= limit)) {
+      paused = !paused;
+      for (size_t i = 0; i < listeners; i++)
+        serve_watch(epoll, EPOLL_CTL_MOD, pollfd[i].fd,
+          paused ? 0 : EPOLLIN, i);
+    }
+
+    /* Sleep until the earliest connection deadline or status update, but
+       wake at least once a minute so a long deadline cannot overflow. */
+    now = monotonic();
+    if (next > 0 && now >= next)
+      next = client_expire(now);
+    if (statusfile.due > 0 && now >= statusfile.due)
+      statusfile_write();
+    deadline = statusfile.due;
+    if (next > 0 && (deadline == 0 || next < deadline))
+      deadline = next;
+    timeout = deadline <= 0 ? -1 : deadline - now < 60
+      ? 1 + 1000 * (deadline - now) : 60000;
+
+    if ((ready = epoll_wait(epoll, events, SERVE_EVENTS, timeout)) < 0) {
+      if (errno != EINTR && errno != EAGAIN)
+        err(EXIT_FAILURE, "epoll_wait");
+      continue;
+    }
+    now = monotonic();
+
+    /* Deal with signals first in case they free additional slots. */
+    for (int i = 0; i < ready; i++)
+      if ((tag = events[i].data.u64) > listeners + 1)
+        clients[tag - listeners - 2].active = now;
+      else if (tag == listeners + 1)
+        logger_read(&logger);
+      else if (tag == listeners)
+        switch (signal_get()) {
+          case SIGCHLD:
+            while ((child = reap(NULL)) > 0) {
+              client_remove(epoll, child);
+              if (stats->active > 0)
+                stats->active--;
+              statusfile_dirty();
+            }
+            break;
+          case SIGHUP:
+            if (logger.output)
+              logger_reopen(&logger);
+            break;
+          case SIGUSR1:
+            warnx("%zu accepted, %zu refused, %zu expired, %zu active",
+              stats->accepted, stats->refused, stats->expired, stats->active);
+            break;
+          case SIGINT:
+          case SIGTERM:
+            cgroup_kill(cgroup);
+            return EXIT_SUCCESS;
+        }
+
+    /* Drain each ready accept queue until we hit our limit. */
+    for (int i = 0; i < ready; i++) {
+      if ((tag = events[i].data.u64) >= listeners)
+        continue;
+      while (stats->active < limit) {
+        length = sizeof(address);
+        connection = accept4(pollfd[tag].fd, (struct sockaddr *) &address,
+          &length, SOCK_CLOEXEC);
+        if (connection < 0)
+          break;
+        peer_set(connection, &address);
+
+        if (persource != (size_t) -1
+            && client_count(peer.source) >= persource) {
+          stats->refused++;
+          statusfile_dirty();
+          close(connection);
+          continue;
+        }
+
+        /* Leave the rest of the queue in the backlog while spawns fail. */
+        if ((child = handler_spawn(argv, peer.env, connection)) <= 0) {
+          if (!failing)
+            warn("spawn");
+          failing = 1;
+          close(connection);
+          break;
+        }
+        failing = 0;
+
+        slot = client_add(child, peer.source, connection, now);
+        if (expiry.idle > 0)
+          serve_watch(epoll, EPOLL_CTL_ADD, clients[slot].fd,
+            EPOLLIN | EPOLLRDHUP | EPOLLET, listeners + 2 + slot);
+        if ((deadline = client_deadline(&clients[slot])) > 0)
+          if (next == 0 || deadline < next)
+            next = deadline;
+        stats->accepted++;
+        stats->active++;
+        statusfile_dirty();
+        close(connection);
+      }
+    }
+  }
+}
+
+static void shard_enter(size_t shard) {
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  cpu_set_t cpu;
+  size_t kept = 0;
+
+  /* Keep only the listeners belonging to this shard. */
+  for (size_t i = 0; i < listeners; i++)
+    if (owners[i] == shard)
+      pollfd[kept++] = pollfd[i];
+    else
+      close(pollfd[i].fd);
+  listeners = kept;
+
+  /* Pin to the CPU steered to this shard. Handlers inherit this unless
+     given their own -C, so ignore errors as the CPU may be offline. */
+  CPU_ZERO(&cpu);
+  CPU_SET(shard % (cpus > 0 ? cpus : 1), &cpu);
+  sched_setaffinity(0, sizeof(cpu), &cpu);
+
+  /* Take our own signals pipe and leave the log pipe to the parent. */
+  close(signals[0]);
+  close(signals[1]);
+  if (pipe2(signals, O_CLOEXEC) < 0)
+    err(EXIT_FAILURE, "pipe");
+  fcntl(signals[1], F_SETFL, O_NONBLOCK);
+  close(logger.pipe[0]);
+  logger.pipe[0] = -1;
+
+  if (pidfile.path) {
+    pidfile.path = NULL;
+    close(pidfile.fd);
+  }
+  statusfile.path = NULL;
+  stats += shard;
+}
+
+static int shard_serve(char **argv, size_t limit, size_t persource) {
+  struct pollfd fds[2] = {
+    { .fd = signals[0], .events = POLLIN },
+    { .fd = logger.pipe[0], .events = POLLIN }
+  };
+  size_t running = 0;
+  pid_t child, *pids;
+  int stopped = 0;
+
+  if (!(pids = calloc(shards, sizeof(pid_t))))
+    err(EXIT_FAILURE, "calloc");
+
+  for (size_t i = 0; i < shards && !stopping; i++)
+    switch (pids[i] = fork()) {
+      case -1:
+        warn("fork");
+        failed = stopping = 1;
+        break;
+      case 0:
+        shard_enter(i);
+        exit(serve(argv, limit, persource));
+      default:
+        running++;
+    }
+  for (size_t i = 0; i < listeners; i++)
+    close(pollfd[i].fd);
+
+  /* Each shard serves its own listeners. If one fails, stop the rest. */
+  while (running > 0) {
+    if (stopping && !stopped++)
+      for (size_t i = 0; i < shards; i++)
+        if (pids[i] > 0)
+          kill(pids[i], SIGTERM);
+
+    /* Publish the shards' shared counters once per interval. */
+    statusfile_write();
+    if (poll(fds, 2, statusfile.path ? 1000 * STATUS_INTERVAL : -1) < 0) {
+      if (errno != EINTR && errno != EAGAIN)
+        err(EXIT_FAILURE, "poll");
+      continue;
+    }
+
+    if (fds[1].revents)
+      logger_read(&logger);
+
+    if (fds[0].revents & POLLIN)
+      switch (signal_get()) {
+        case SIGCHLD:
+          while ((child = reap(NULL)))
+            for (size_t i = 0; i < shards; i++)
+              if (pids[i] == child) {
+                if (!stopping)
+                  warnx("Shard %zu exited unexpectedly", i);
+                failed |= !stopping;
+                stopping = 1;
+                pids[i] = 0;
+                running--;
+              }
+          break;
+        case SIGHUP:
+          if (logger.output)
+            logger_reopen(&logger);
+          break;
+        case SIGUSR1:
+          for (size_t i = 0; i < shards; i++)
+            if (pids[i] > 0)
+              kill(pids[i], SIGUSR1);
+          break;
+        case SIGINT:
+        case SIGTERM:
+          stopping = 1;
+          break;
+      }
+  }
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+static int prefork_idle(pid_t pid) {
+  char path[32];
+  FILE *file;
+  long call, fd;
+  int idle = 0;
+
+  /* A worker blocked in accept() on its stdin is not serving anyone. */
+  snprintf(path, sizeof(path), "/proc/%d/syscall", pid);
+  if ((file = fopen(path, "re"))) {
+    if (fscanf(file, "%ld %lx", &call, &fd) == 2 && fd == STDIN_FILENO)
+      idle = call == __NR_accept || call == __NR_accept4;
+    fclose(file);
+  }
+  return idle;
+}
+
+static int prefork(char **argv, size_t min, size_t max) {
+  struct pollfd fds[3] = {
+    { .fd = pollfd[0].fd, .events = POLLIN },
+    { .fd = signals[0], .events = POLLIN },
+    { .fd = logger.pipe[0], .events = POLLIN }
+  };
+  struct {
+    pid_t pid;
+    double started;
+  } *workers;
+  double busy = 0, calm = monotonic(), next = 0, now;
+  int signal, timeout;
+  size_t count = 0;
+  pid_t child;
+
+  /* Workers inherit the listener as stdin and block in accept() on it. */
+  if (!(workers = calloc(max, sizeof(*workers))))
+    err(EXIT_FAILURE, "calloc");
+  fcntl(fds[0].fd, F_SETFL, 0);
+
+  while (1) {
+    now = monotonic();
+
+    /* A backlog that outlasts the grace period means all are busy. */
+    if (busy && now >= busy + POOL_GRACE) {
+      busy = 0;
+      if (poll(&(struct pollfd) { fds[0].fd, POLLIN }, 1, 0) > 0) {
+        busy = calm = now;
+        if (count < max && now >= next) {
+          workers[count].pid = handler_spawn(argv, environ, fds[0].fd);
+          if (workers[count].pid > 0)
+            workers[count++].started = now;
+        }
+      }
+    }
+
+    /* Keep at least MIN workers, pausing if they keep dying young or
+       cannot be started at all. */
+    while (count < min && now >= next) {
+      if ((workers[count].pid = handler_spawn(argv, environ, fds[0].fd)) <= 0) {
+        next = now + backoff.min;
+        break;
+      }
+      workers[count++].started = now;
+    }
+
+    /* Once the backlog has been clear for a while, retire an idle worker.
+       It may still accept a connection before SIGTERM arrives. */
+    if (count > min && now >= calm + POOL_IDLE) {
+      calm = now;
+      for (size_t i = count; i-- > 0;)
+        if (prefork_idle(workers[i].pid)) {
+          kill(workers[i].pid, SIGTERM);
+          break;
+        }
+    }
+
+    fds[0].events = busy ? 0 : POLLIN;
+    if (busy)
+      timeout = (busy + POOL_GRACE - now) * 1000 + 1;
+    else if (count < min)
+      timeout = next > now ? (next - now) * 1000 + 1 : 0;
+    else
+      timeout = count > min ? 1000 : -1;
+
+    while (poll(fds, 3, timeout) < 0)
+      if (errno != EAGAIN && errno != EINTR)
+        err(EXIT_FAILURE, "poll");
+
+    if (fds[0].revents & POLLIN)
+      busy = monotonic();
+    if (fds[2].revents)
+      logger_read(&logger);
+    if (!(fds[1].revents & POLLIN))
+      continue;
+
+    switch (signal = signal_get()) {
+      case SIGCHLD:
+        while ((child = reap(NULL)))
+          for (size_t i = 0; i < count; i++)
+            if (workers[i].pid == child) {
+              if (monotonic() < workers[i].started + 1) {
+                warnx("Worker died within 1 second: pausing restarts");
+                next = monotonic() + backoff.min;
+              }
+              workers[i] = workers[--count];
+              break;
+            }
+        break;
+      case SIGHUP:
+        if (logger.output)
+          logger_reopen(&logger);
+        /* Fall through to pass the signal on. */
+      case SIGUSR1:
+      case SIGUSR2:
+        for (size_t i = 0; i < count; i++)
+          kill(workers[i].pid, signal);
+        break;
+      case SIGINT:
+      case SIGTERM:
+        for (size_t i = 0; i < count; i++)
+          kill(workers[i].pid, SIGTERM);
+        cgroup_kill(cgroup);
+        return EXIT_SUCCESS;
+    }
+  }
+}
+
+static int process_open(pid_t pid) {
+  /* Older kernels lack pidfds, in which case we fall back to SIGCHLD. */
+  return syscall(__NR_pidfd_open, pid, 0);
+}
+
+static void process_kill(int pidfd, pid_t pid, int signal) {
+  if (pidfd < 0 || syscall(__NR_pidfd_send_signal, pidfd, signal, NULL, 0) < 0)
+    kill(pid, signal);
+}
+
+static int supervise(char **argv, int session) {
+  struct pollfd fds[4] = {
+    { .fd = signals[0], .events = POLLIN },
+    { .fd = -1, .events = POLLIN },
+    { .fd = logger.pipe[0], .events = POLLIN },
+    { .fd = -1, .events = POLLIN }
+  };
+  double delay = 0, pause, next = 0, remaining, started = 0;
+  int ends[2], restart = 1, signal, signalled = 0, status, timeout;
+  pid_t command = 0;
+  unsigned long restarts = 0;
+
+  srandom(getpid() ^ time(NULL));
+
+  while (command || restart) {
+    if (!command && monotonic() >= next) {
+      /* Each run of the command gets a fresh notification pipe. */
+      fds[1].fd = notify >= 0 ? notify_start(ends) : -1;
+
+      switch (command = spawn(cgroup)) {
+        case -1:
+          err(EXIT_FAILURE, "fork");
+        case 0:
+          if (pidfile.path) {
+            pidfile.path = NULL;
+            close(pidfile.fd);
+          }
+          if (notify >= 0)
+            notify_child(ends);
+          if (activate)
+            listen_pass();
+          if (session)
+            setsid(); /* Ignore errors but should always work after fork. */
+          execute(argv);
+      }
+      if (notify >= 0)
+        close(ends[1]);
+
+      fds[3].fd = process_open(command);
+      started = monotonic();
+      signalled = 0;
+      timeline_add(NULL, "spawn %d", command);
+
+      statusfile.child = command;
+      statusfile.since = time(NULL);
+      statusfile_write();
+    }
+
+    /* While backing off, sleep until the next start is due, but wake at
+       least once a minute so a long backoff cannot overflow. */
+    timeout = -1;
+    if (!command) {
+      remaining = next - monotonic();
+      timeout = remaining <= 0 ? 0 : remaining < 60 ? 1 + 1000 * remaining
+        : 60000;
+    }
+    while (poll(fds, 4, timeout) < 0)
+      if (errno != EAGAIN && errno != EINTR)
+        err(EXIT_FAILURE, "poll");
+
+    if (fds[2].revents)
+      logger_read(&logger);
+
+    /* The first notification of readiness moves the pidfile into place. */
+    if (fds[1].revents && (status = notify_read(fds[1].fd))) {
+      if (status > 0) {
+        timeline_add(NULL, "ready");
+        pidfile_ready();
+      }
+      close(fds[1].fd);
+      fds[1].fd = -1;
+    }
+
+    /* Reopen our log file on SIGHUP as well as passing it on. */
+    signal = fds[0].revents & POLLIN ? signal_get() : 0;
+    if (signal == SIGHUP && logger.output)
+      logger_reopen(&logger);
+
+    switch (signal) {
+      case SIGTERM:
+        restart = 0;
+        /* Fall through to the default behaviour. */
+      case SIGHUP:
+      case SIGINT:
+      case SIGUSR1:
+      case SIGUSR2:
+        /* Pass signals on to our child process. */
+        if (command)
+          process_kill(fds[3].fd, command, signal);
+        signalled = 1;
+    }
+
+    /* Reap the command once its pidfd polls readable or on SIGCHLD. */
+    if (!command || !(fds[3].revents || signal == SIGCHLD))
+      continue;
+    if (waitpid(command, &status, WNOHANG) != command)
+      continue;
+
+    /* Kill anything left behind in the cgroup before restarting. */
+    timeline_exit(NULL, status);
+    command = statusfile.child = 0;
+    statusfile.status = status;
+    cgroup_kill(cgroup);
+    if (fds[1].fd >= 0)
+      close(fds[1].fd);
+    if (fds[3].fd >= 0)
+      close(fds[3].fd);
+    fds[1].fd = fds[3].fd = -1;
+    if (!restart)
+      break;
+
+    /* Back off exponentially while the command keeps dying quickly. */
+    if (signalled || monotonic() - started >= backoff.max)
+      delay = 0;
+    else
+      delay = delay < backoff.min ? backoff.min
+        : delay * 2 < backoff.max ? delay * 2 : backoff.max;
+    pause = delay / 2 + delay / 2 * random() / RAND_MAX;
+    next = monotonic() + pause;
+
+    statusfile.restarts = ++restarts;
+    statusfile_write();
+    if (WIFSIGNALED(status))
+      warnx("Child killed by signal %d: restart %lu in %.1fs",
+        WTERMSIG(status), restarts, pause);
+    else
+      warnx("Child exited with status %d: restart %lu in %.1fs",
+        WEXITSTATUS(status), restarts, pause);
+  }
+
+  return EXIT_SUCCESS;
+}
+
+#define SERVICE_OPTIONS "+:cd:fg:l:p:rR:u:w:z:C:D:G:I:L:N:S:"
+
+static int manifest_split(char *line, char ***words) {
+  char *cursor = line, *output, *word, next, quote;
+  int count = 0;
+
+  *words = NULL;
+  while (1) {
+    /* Words are separated by whitespace, and # starts a comment. */
+    cursor += strspn(cursor, " \t\n");
+    if (*cursor == 0 || *cursor == '#')
+      break;
+
+    /* Unquote the word in place, shell-style but without expansions. */
+    for (word = output = cursor, quote = 0; *cursor; cursor++)
+      if (!quote && strchr(" \t\n", *cursor))
+        break;
+      else if (*cursor == quote)
+        quote = 0;
+      else if (!quote && (*cursor == '"' || *cursor == '\''))
+        quote = *cursor;
+      else if (*cursor == '\\' && quote != '\'' && cursor[1])
+        *output++ = *++cursor;
+      else
+        *output++ = *cursor;
+    if (quote)
+      return -1;
+
+    next = *cursor, *output = 0;
+    cursor += next != 0;
+    if (!(*words = realloc(*words, (count + 2) * sizeof(char *))))
+      err(EXIT_FAILURE, "realloc");
+    if (!((*words)[count++] = strdup(word)))
+      err(EXIT_FAILURE, "strdup");
+  }
+
+  if (*words)
+    (*words)[count] = NULL;
+  return count;
+}
+
+static void manifest_load(char *path) {
+  char *line = NULL, **words;
+  size_t number = 0, size = 0;
+  struct service *service;
+  struct tuning scratch;
+  int count, option, tail;
+  FILE *file;
+
+  if (!(file = fopen(path, "re")))
+    err(EXIT_FAILURE, "%s", path);
+
+  while (getline(&line, &size, file) > 0) {
+    number++;
+    if ((count = manifest_split(line, &words)) < 0)
+      errx(EXIT_FAILURE, "%s:%zu: Unterminated quote", path, number);
+    if (count == 0)
+      continue;
+
+    if ((managed & 15) == 0) {
+      services = realloc(services, (managed + 16) * sizeof(*services));
+      if (services == NULL)
+        err(EXIT_FAILURE, "realloc");
+    }
+
+    service = services + managed++;
+    *service = (struct service) {
+      .name = words[0], .words = words, .count = count,
+      .log = { .file = -1, .pipe = { -1, -1 } },
+      .cgroup = -1, .notify = -1, .ready = -1, .session = 1,
+      .gid = gid, .uid = uid
+    };
+
+    optind = 0;
+    while ((option = getopt(count, words, SERVICE_OPTIONS)) > 0)
+      switch (option) {
+        case 'f':
+          service->session = 0;
+          break;
+        case 'g':
+          if (service->cgroup >= 0)
+            close(service->cgroup);
+          service->cgroup = cgroup_open(optarg);
+          break;
+        case 'l':
+          logger_setup(&service->log, optarg);
+          break;
+        case 'p':
+          if (service->pidfile)
+            errx(EXIT_FAILURE, "%s:%zu: -p cannot be specified more than "
+              "once", path, number);
+          service->pidfile = optarg;
+          break;
+        case 'r':
+          service->restart = 1;
+          break;
+        case 'R':
+          if (sscanf(optarg, "%d%n", &service->notify, &tail) >= 1)
+            if (optarg[tail] == 0 && service->notify > STDERR_FILENO)
+              break;
+          errx(EXIT_FAILURE, "%s:%zu: Invalid notification fd", path, number);
+        case 'u':
+          credentials(optarg, &service->uid, &service->gid);
+          break;
+        case 'z':
+          logger_limit(&service->log, optarg);
+          break;
+        case 'C':
+        case 'I':
+        case 'L':
+        case 'N':
+        case 'S':
+          /* Check these now, though each child applies them itself. */
+          tune(&scratch, option, optarg);
+          break;
+        case 'c':
+        case 'd':
+        case 'w':
+        case 'D':
+        case 'G':
+          break;
+        default:
+          errx(EXIT_FAILURE, "%s:%zu: Invalid service options", path, number);
+      }
+
+    if (optind >= count)
+      errx(EXIT_FAILURE, "%s:%zu: Missing command", path, number);
+    if (service->log.output && service->log.file < 0)
+      errx(EXIT_FAILURE, "%s:%zu: -z needs -l LOGFILE", path, number);
+
+    /* Apply -G settings once the cgroup is known. */
+    optind = 0;
+    while ((option = getopt(count, words, SERVICE_OPTIONS)) > 0)
+      if (option == 'G' && service->cgroup < 0)
+        errx(EXIT_FAILURE, "%s:%zu: -G needs -g CGROUP", path, number);
+      else if (option == 'G')
+        cgroup_set(service->cgroup, optarg);
+    service->argv = words + optind;
+    for (size_t i = 0; i + 1 < managed; i++)
+      if (!strcmp(services[i].name, service->name))
+        errx(EXIT_FAILURE, "%s:%zu: Duplicate service", path, number);
   }
 
-  if (address[tail] != 0)
-    errx(EXIT_FAILURE, "%s: Invalid address", address);
-
-  if ((status = getaddrinfo(host, port, &hints, &list)) != 0)
-    errx(EXIT_FAILURE, "getaddrinfo: %s", gai_strerror(status));
-
-  for (info = list; info != NULL; info = info->ai_next) {
-    if ((fd = socket(info->ai_family, info->ai_socktype, 0)) < 0)
-      err(EXIT_FAILURE, "socket");
-    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &(int) { 1 }, sizeof(int));
-    fcntl(fd, F_SETFD, FD_CLOEXEC);
-    fcntl(fd, F_SETFL, O_NONBLOCK);
+  if (ferror(file))
+    err(EXIT_FAILURE, "%s", path);
+  fclose(file);
+  free(line);
+}
 
-    if (bind(fd, info->ai_addr, info->ai_addrlen) < 0)
-      err(EXIT_FAILURE, "bind");
-    if (listen(fd, SOMAXCONN) < 0)
-      err(EXIT_FAILURE, "listen");
-    listen_add(fd);
+static void manifest_link(void) {
+  size_t *order, ordered = 0;
+  int option;
+
+  /* Resolve -D dependencies into service indices. */
+  for (size_t i = 0; i < managed; i++) {
+    optind = 0;
+    while ((option = getopt(services[i].count, services[i].words,
+        SERVICE_OPTIONS)) > 0)
+      if (option == 'D') {
+        size_t j = 0;
+        while (j < managed && strcmp(services[j].name, optarg))
+          j++;
+        if (j == managed)
+          errx(EXIT_FAILURE, "%s: Unknown dependency %s", services[i].name,
+            optarg);
+        services[i].needs = realloc(services[i].needs,
+          (services[i].needed + 1) * sizeof(size_t));
+        if (services[i].needs == NULL)
+          err(EXIT_FAILURE, "realloc");
+        services[i].needs[services[i].needed++] = j;
+      }
+    services[i].pending = services[i].needed;
   }
-}
 
-static void listen_unix(const char *path) {
-  struct sockaddr_un address;
-  size_t length = strlen(path);
-  int fd;
+  /* Check the dependency graph is acyclic by ordering it topologically. */
+  if (!(order = malloc(managed * sizeof(size_t))))
+    err(EXIT_FAILURE, "malloc");
+  for (size_t i = 0; i < managed; i++)
+    if (services[i].pending == 0)
+      order[ordered++] = i;
+  for (size_t k = 0; k < ordered; k++)
+    for (size_t i = 0; i < managed; i++)
+      for (size_t j = 0; j < services[i].needed; j++)
+        if (services[i].needs[j] == order[k] && --services[i].pending == 0)
+          order[ordered++] = i;
+  for (size_t i = 0; i < managed; i++)
+    if (services[i].pending)
+      errx(EXIT_FAILURE, "%s: Dependency cycle", services[i].name);
+    else
+      services[i].pending = services[i].needed;
+  free(order);
+}
 
-  /* On Linux, address.sun_path is NUL-padded not NUL-terminated. */
-  if (length > sizeof(address.sun_path))
-    errx(EXIT_FAILURE, "Socket path is too long to bind");
-  length += offsetof(struct sockaddr_un, sun_path);
+static void service_exec(struct service *service, int ends[2]) {
+  char *dir = NULL;
+  int option;
 
-  address.sun_family = AF_UNIX;
-  strncpy(address.sun_path, path, sizeof(address.sun_path));
-  unlink(path);
+  /* Drop the settings of the manager itself. */
+  if (pidfile.path) {
+    pidfile.path = NULL;
+    close(pidfile.fd);
+  }
 
-  if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
-    err(EXIT_FAILURE, "socket");
-  fcntl(fd, F_SETFD, FD_CLOEXEC);
-  fcntl(fd, F_SETFL, O_NONBLOCK);
+  /* Each service logs to its own file or pipe, else shares the manager's. */
+  if (service->log.pipe[1] >= 0)
+    logger_redirect(service->log.pipe[1]);
+  else if (service->log.file >= 0)
+    logger_redirect(service->log.file);
+  if (console)
+    stderr = console;
+
+  if (service->session)
+    setsid(); /* Ignore errors but should always work after fork. */
+  gid = service->gid;
+  uid = service->uid;
+  if ((notify = service->notify) >= 0)
+    notify_child(ends);
+
+  optind = 0;
+  while ((option = getopt(service->count, service->words,
+      SERVICE_OPTIONS)) > 0)
+    switch (option) {
+      case 'c':
+        dir = "/";
+        break;
+      case 'd':
+        dir = optarg;
+        break;
+      case 'p':
+        pidfile_open(optarg);
+        break;
+      case 'C':
+      case 'I':
+      case 'L':
+      case 'N':
+      case 'S':
+        tune(&tuning, option, optarg);
+        break;
+    }
 
-  if (bind(fd, (struct sockaddr *) &address, length) < 0)
-    err(EXIT_FAILURE, "bind");
-  if (listen(fd, SOMAXCONN) < 0)
-    err(EXIT_FAILURE, "listen");
-  listen_add(fd);
+  pidfile_write();
+  if (dir && chdir(dir) < 0)
+    err(EXIT_FAILURE, "chdir %s", dir);
+  execute(service->argv);
 }
 
-static void logger_setup(const char *spec) {
-  int status;
-  pid_t pid;
+static void service_start(size_t index);
 
-  if (logger.tag)
-    errx(EXIT_FAILURE, "-l cannot be specified more than once");
-  if (!*spec || *spec == ':')
-    errx(EXIT_FAILURE, "Invalid or missing syslog identifier tag");
-  if (!(logger.tag = strdup(spec)))
-    err(EXIT_FAILURE, "strdup");
+static void service_fail(size_t index) {
+  services[index].state = FAILED;
+  failed = 1;
 
-  /* Logging to file indicated by absolute path. */
-  if (*logger.tag == '/') {
-    logger.fd = open(logger.tag, O_RDWR | O_APPEND | O_CREAT, 0666);
-    if (logger.fd < 0)
-      err(EXIT_FAILURE, "%s", logger.tag);
-    if (flock(logger.fd, LOCK_EX | LOCK_NB) < 0)
-      errx(EXIT_FAILURE, "%s already locked", logger.tag);
-    return;
-  }
+  /* Nothing that depends on a failed service can be started. */
+  for (size_t i = 0; i < managed; i++)
+    for (size_t j = 0; j < services[i].needed; j++)
+      if (services[i].needs[j] == index && services[i].state == WAITING) {
+        warnx("%s: Not starting as %s failed", services[i].name,
+          services[index].name);
+        service_fail(i);
+      }
+}
 
-  /* Log spec format is TAG:PRIORITY. */
-  if ((logger.priority = strchr(logger.tag, ':'))) {
-    *logger.priority++ = 0;
-    if (!*logger.priority)
-      logger.priority = NULL;
-  }
+static void service_ready(size_t index) {
+  if (--services[index].pending == 0 && services[index].state == WAITING)
+    if (!stopping)
+      service_start(index);
+}
 
-  /* Test the logger settings so we can exit early if they are invalid. */
-  switch (pid = fork()) {
-    case -1:
-      err(EXIT_FAILURE, "fork");
-    case 0:
-      if (chdir("/") < 0)
-        err(EXIT_FAILURE, "chdir");
-      execlp("logger", "logger", "-f", "/dev/null",
-          "-p", logger.priority ? logger.priority : "daemon.notice",
-          "-t", logger.tag, NULL);
-      err(EXIT_FAILURE, "exec");
-  }
+static void service_up(size_t index) {
+  struct service *service = services + index;
+  char path[PATH_MAX];
 
-  if (waitpid(pid, &status, 0) < 0)
-    err(EXIT_FAILURE, "waitpid");
+  /* Move the pidfile into place if the service waited for readiness,
+     including after each restart, but release dependents only once. */
+  if (service->pidfile && service->notify >= 0 && service->pid > 0) {
+    snprintf(path, sizeof(path), "%s.new", service->pidfile);
+    if (rename(path, service->pidfile) < 0)
+      warn("rename %s", path);
+  }
 
-  /* The logger subprocess writes its own message to stderr on failure. */
-  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
-    exit(EXIT_FAILURE);
+  if (service->up)
+    return;
+  service->up = 1;
+  timeline_add(service->name, "ready");
+
+  for (size_t i = 0; i < managed; i++)
+    for (size_t j = 0; j < services[i].needed; j++)
+      if (services[i].needs[j] == index) {
+        timeline_add(services[i].name, "found %s", service->name);
+        service_ready(i);
+      }
 }
 
-static void logger_start(void) {
-  int logpipe[2];
+static void service_start(size_t index) {
+  struct service *service = services + index;
+  int ends[2];
 
-  /* Redirect stdout and stderr to /dev/null if logging isn't configured. */
-  if (!logger.tag) {
-    if (dup2(STDIN_FILENO, STDOUT_FILENO) < 0)
-      err(EXIT_FAILURE, "dup2");
-    if (dup2(STDIN_FILENO, STDERR_FILENO) < 0)
-      err(EXIT_FAILURE, "dup2");
-    return;
-  }
+  if (service->notify >= 0)
+    notify_start(ends);
 
-  /* Redirect stdout and stderr if a log file has been specified. */
-  if (*logger.tag == '/') {
-    if (dup2(logger.fd, STDOUT_FILENO) < 0)
-      err(EXIT_FAILURE, "dup2");
-    if (dup2(logger.fd, STDERR_FILENO) < 0)
-      err(EXIT_FAILURE, "dup2");
-    if (logger.fd != STDOUT_FILENO && logger.fd != STDERR_FILENO)
-      close(logger.fd);
-    return;
-  }
+  /* The manager keeps both ends of a log pipe open across restarts. */
+  if ((service->log.header || service->log.output) && service->log.pipe[0] < 0)
+    logger_pipe(&service->log);
 
-  if (pipe(logpipe) < 0)
-    err(EXIT_FAILURE, "pipe");
-  switch (fork()) {
+  service->started = time(NULL);
+  switch (service->pid = spawn(service->cgroup)) {
     case -1:
-      err(EXIT_FAILURE, "fork");
+      warn("%s: fork", service->name);
+      service_fail(index);
+      return;
     case 0:
-      /* Don't unintentionally keep the pwd busy in the logger process. */
-      if (chdir("/") < 0)
-        err(EXIT_FAILURE, "chdir");
-      /* Redirect stdout and stderr to /dev/null for the logger process. */
-      if (dup2(STDIN_FILENO, STDOUT_FILENO) < 0)
-        err(EXIT_FAILURE, "dup2");
-      if (dup2(STDIN_FILENO, STDERR_FILENO) < 0)
-        err(EXIT_FAILURE, "dup2");
-      /* Run logger(1) with stdin coming from the read end of the pipe. */
-      if (dup2(logpipe[0], STDIN_FILENO) < 0)
-        err(EXIT_FAILURE, "dup2");
-      close(logpipe[0]);
-      close(logpipe[1]);
-      execlp("logger", "logger",
-          "-p", logger.priority ? logger.priority : "daemon.notice",
-          "-t", logger.tag, NULL);
-      err(EXIT_FAILURE, "exec");
+      service_exec(service, ends);
   }
+  timeline_add(service->name, "spawn %d", service->pid);
 
-  /* Redirect our stdout and stderr to the write end of the pipe. */
-  if (dup2(logpipe[1], STDOUT_FILENO) < 0)
-    err(EXIT_FAILURE, "dup2");
-  if (dup2(logpipe[1], STDERR_FILENO) < 0)
-    err(EXIT_FAILURE, "dup2");
-  close(logpipe[0]);
-  close(logpipe[1]);
-}
-
-static void pidfile_close(void) {
-  if (pidfile.path) {
-    close(pidfile.fd);
-    unlink(pidfile.path);
+  if (service->notify >= 0) {
+    close(ends[1]);
+    if (service->ready >= 0)
+      close(service->ready);
+    service->ready = ends[0];
   }
-}
-
-static void pidfile_open(const char *path) {
-  pidfile.fd = open(path, O_RDWR | O_CREAT, 0666);
-  if (pidfile.fd < 0)
-    err(EXIT_FAILURE, "%s", path);
-  if (flock(pidfile.fd, LOCK_EX | LOCK_NB) < 0)
-    errx(EXIT_FAILURE, "%s already locked", path);
-  if (!(pidfile.path = realpath(path, NULL)))
-    err(EXIT_FAILURE, "%s", path);
-  if (ftruncate(pidfile.fd, 0) < 0)
-    err(EXIT_FAILURE, "%s", path);
-  atexit(pidfile_close);
-}
 
-static void pidfile_write(void) {
-  if (pidfile.path && dprintf(pidfile.fd, "%d\n", getpid()) < 0)
-    err(EXIT_FAILURE, "dprintf");
+  /* Without notification, a supervised service is ready once started. */
+  service->state = RUNNING;
+  if (service->restart && service->notify < 0)
+    service_up(index);
 }
 
-static pid_t reap(int *status) {
-  pid_t child;
+static void service_exit(pid_t child, int status) {
+  struct service *service;
+  char path[PATH_MAX];
+  size_t index;
 
-  while ((child = waitpid(-1, status, WNOHANG)) < 0)
-    if (errno != EINTR)
+  for (index = 0; index < managed; index++)
+    if (services[index].state == RUNNING && services[index].pid == child)
       break;
-  return child > 0 ? child : 0;
-}
+  if (index == managed)
+    return;
 
-static int signal_get(void) {
-  unsigned char signal = 0;
-  while (read(signals[0], &signal, 1) < 0)
-    if (errno != EINTR)
-      break;
-  return signal;
-}
+  service = services + index;
+  service->pid = 0;
+  timeline_exit(service->name, status);
+  cgroup_kill(service->cgroup);
+  if (service->ready >= 0) {
+    close(service->ready);
+    service->ready = -1;
+  }
+  if (service->pidfile) {
+    snprintf(path, sizeof(path), "%s.new", service->pidfile);
+    unlink(service->pidfile);
+    unlink(path);
+  }
 
-static void signal_put(int signal) {
-  while (write(signals[1], &(unsigned char) { signal }, 1) < 0)
-    if (errno != EINTR)
-      break;
+  if (stopping) {
+    service->state = DONE;
+  } else if (service->restart) {
+    /* Try to avoid restarting a crashing command in a tight loop. */
+    if (time(NULL) < service->started + 5) {
+      warnx("%s: Died within 5 seconds: not restarting", service->name);
+      service_fail(index);
+    } else {
+      service_start(index);
+    }
+  } else if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+    service->state = DONE;
+    service_up(index);
+  } else {
+    warnx("%s: Failed", service->name);
+    service_fail(index);
+  }
 }
 
-static void execute(char **argv) {
-  if (gid > 0 && setgid(gid) < 0)
-    err(EXIT_FAILURE, "setgid");
-  if (uid > 0 && setuid(uid) < 0)
-    err(EXIT_FAILURE, "setuid");
-  execvp(argv[0], argv);
-  err(EXIT_FAILURE, "exec");
-}
+static int manage(void) {
+  struct pollfd *fds;
+  size_t running;
+  int option, signal, status;
+  pid_t child;
 
-static int serve(char **argv, size_t limit) {
-  int connection;
-  size_t count = 0;
+  /* Count -w paths not yet present as extra dependencies of a service. */
+  for (size_t i = 0; i < managed; i++) {
+    for (size_t j = 0; j < services[i].needed; j++)
+      timeline_add(services[i].name, "wait %s",
+        services[services[i].needs[j]].name);
+    optind = 0;
+    while ((option = getopt(services[i].count, services[i].words,
+        SERVICE_OPTIONS)) > 0)
+      if (option == 'w' && await_add(optarg, i)) {
+        timeline_add(services[i].name, "wait %s", optarg);
+        services[i].pending++;
+      }
+  }
 
-  listen_add(signals[0]);
-  pollfd[listeners - 1].events = POLLIN;
+  for (size_t i = 0; i < managed; i++)
+    if (services[i].pending == 0 && services[i].state == WAITING)
+      service_start(i);
+
+  /* Poll signals, inotify, our log pipe, then each service's pipes. */
+  if (!(fds = calloc(2 * managed + 3, sizeof(struct pollfd))))
+    err(EXIT_FAILURE, "calloc");
+  fds[0] = (struct pollfd) { .fd = signals[0], .events = POLLIN };
+  fds[1] = (struct pollfd) { .fd = inotify, .events = POLLIN };
+  fds[2] = (struct pollfd) { .fd = logger.pipe[0], .events = POLLIN };
 
   while (1) {
-    /* Only listen for new connections when below the connection limit. */
-    for (size_t i = 0; i + 1 < listeners; i++)
-      pollfd[i].events = count < limit ? POLLIN : 0;
+    /* Exit once nothing is running and nothing else can be started. */
+    for (size_t i = running = 0; i < managed; i++) {
+      running += services[i].state == RUNNING;
+      fds[i + 3] = (struct pollfd) { services[i].ready, POLLIN };
+      fds[managed + i + 3] = (struct pollfd) {
+        services[i].log.pipe[0], POLLIN
+      };
+    }
+    if (running == 0 && (stopping || awaiting == 0))
+      return failed ? EXIT_FAILURE : EXIT_SUCCESS;
 
-    if (poll(pollfd, listeners, -1) < 0) {
+    if (poll(fds, 2 * managed + 3, -1) < 0) {
       if (errno != EINTR && errno != EAGAIN)
         err(EXIT_FAILURE, "poll");
       continue;
     }
 
-    /* Deal with signals first in case they free additional slots. */
-    if (pollfd[listeners - 1].revents & POLLIN)
-      switch (signal_get()) {
-        case SIGCHLD:
-          while (reap(NULL) > 0)
-            if (count > 0)
-              count--;
-          break;
-        case SIGINT:
-        case SIGTERM:
-          return EXIT_SUCCESS;
+    if (fds[1].revents & POLLIN)
+      await_read(service_ready);
+
+    if (fds[2].revents)
+      logger_read(&logger);
+    for (size_t i = 0; i < managed; i++)
+      if (fds[managed + i + 3].revents)
+        logger_read(&services[i].log);
+
+    for (size_t i = 0; i < managed; i++)
+      if (fds[i + 3].revents && (status = notify_read(services[i].ready))) {
+        close(services[i].ready);
+        services[i].ready = -1;
+        if (status > 0)
+          service_up(i);
       }
 
-    /* Accept connections from ready listeners until we hit our limit. */
-    for (size_t i = 0; i + 1 < listeners; i++)
-      if (pollfd[i].revents & POLLIN && count < limit)
-        if ((connection = accept(pollfd[i].fd, NULL, NULL)) >= 0) {
-          switch (fork()) {
-            case -1:
-              break;
-            case 0:
-              if (pidfile.path) {
-                pidfile.path = NULL;
-                close(pidfile.fd);
-              }
-              if (dup2(connection, STDIN_FILENO) < 0)
-                err(EXIT_FAILURE, "dup2");
-              if (dup2(connection, STDOUT_FILENO) < 0)
-                err(EXIT_FAILURE, "dup2");
-              close(connection);
-              execute(argv);
-            default:
-              count++;
-          }
-          close(connection);
-        }
-  }
-}
-
-static int supervise(char **argv, int session) {
-  int restart = 1, signal;
-  pid_t child, command;
-  time_t wait;
+    if (!(fds[0].revents & POLLIN))
+      continue;
 
-  do {
-    switch (command = fork()) {
-      case -1:
-        err(EXIT_FAILURE, "fork");
-      case 0:
-        if (pidfile.path) {
-          pidfile.path = NULL;
-          close(pidfile.fd);
-        }
-        if (session)
-          setsid(); /* Ignore errors but should always work after fork. */
-        execute(argv);
+    /* Reopen all managed log files on SIGHUP as well as passing it on. */
+    if ((signal = signal_get()) == SIGHUP) {
+      if (logger.output)
+        logger_reopen(&logger);
+      for (size_t i = 0; i < managed; i++)
+        if (services[i].log.output)
+          logger_reopen(&services[i].log);
     }
 
-    wait = time(NULL) + 5;
-    while (command)
-      switch (signal = signal_get()) {
-        case SIGCHLD:
-          /* Reap every child, watching out for the command pid. */
-          while ((child = reap(NULL)))
-            if (child == command)
-              command = 0;
-          break;
-        case SIGTERM:
-          restart = 0;
-          /* Fall through to the default behaviour. */
-        case SIGHUP:
-        case SIGINT:
-        case SIGUSR1:
-        case SIGUSR2:
-          /* Pass signals on to our child process. */
-          kill(command, signal);
-          wait = 0;
-      }
-
-    /* Try to avoid restarting a crashing command in a tight loop. */
-    if (restart && time(NULL) < wait)
-      errx(EXIT_FAILURE, "Child died within 5 seconds: not restarting");
-  } while (restart);
-
-  return EXIT_SUCCESS;
+    switch (signal) {
+      case SIGCHLD:
+        while ((child = reap(&status)))
+          service_exit(child, status);
+        break;
+      case SIGTERM:
+      case SIGINT:
+        stopping = 1;
+        /* Fall through to pass the signal on. */
+      case SIGHUP:
+      case SIGUSR1:
+      case SIGUSR2:
+        for (size_t i = 0; i < managed; i++)
+          if (services[i].state == RUNNING)
+            kill(services[i].pid, signal);
+    }
+  }
 }
 
 static void usage(char *progname) {
   fprintf(stderr, "\
-Usage: %s [OPTIONS] CMD [ARG]...\n\
+Usage: %1$s [OPTIONS] CMD [ARG]...\n\
+       %1$s [OPTIONS] -m MANIFEST\n\
 Options:\n\
+  -a            pass -s and -t listeners to the command as fds 3 and up,\n\
+                  setting LISTEN_FDS and LISTEN_PID, and with -r hold\n\
+                  them open across restarts so no connection is refused\n\
+  -b MIN[:MAX]  with -r, restart a failing command after a delay doubling\n\
+                  from MIN to MAX seconds, with jitter, default 1:60, or\n\
+                  with -P, pause MIN seconds if workers keep dying young\n\
+  -C CPUS       run the command on the listed CPUs, given as in 0-3,6\n\
   -d DIR        change directory to DIR before running the command\n\
+  -e LIFE:IDLE  kill a connection handler LIFE seconds after it starts,\n\
+                  or once its connection has been idle for IDLE secs,\n\
+                  with either left empty or 0 for no limit\n\
   -f            do not run the command as a session leader\n\
-  -l TAG:PRI    redirect stdout and stderr to a logger subprocess,\n\
-                  using syslog tag TAG and priority/facility PRI\n\
+  -g CGROUP     run the command in cgroup CGROUP, created if necessary,\n\
+                  relative to /sys/fs/cgroup unless given as an absolute\n\
+                  path, and kill everything left in it when it stops\n\
+  -G KEY=VALUE  with -g, write VALUE to the cgroup file KEY, such as\n\
+                  memory.max, cpu.weight, io.weight or pids.max\n\
+  -I CLASS:LVL  set I/O scheduling class realtime, best-effort or idle,\n\
+                  with an optional priority level LVL from 0 to 7\n\
+  -j SHARDS     bind SHARDS SO_REUSEPORT sockets for each -t address and\n\
+                  serve them from as many processes, each pinned to a\n\
+                  CPU, or with -j cpu, one per CPU with connections\n\
+                  steered to the shard on the CPU that received them\n\
+  -l TAG:PRI    send lines of stdout and stderr to syslog with tag TAG\n\
+                  and [facility.]priority PRI, default daemon.notice\n\
   -l LOGFILE    append stdout and stderr to a file LOGFILE, which must be\n\
                   given as an absolute path whose first character is '/'\n\
-  -n LIMIT      allow no more than LIMIT concurrent socket connections\n\
+  -L RES=LIMIT  set resource limit RES, such as nofile or core, to a\n\
+                  soft and optional hard limit SOFT:HARD or unlimited\n\
+  -m MANIFEST   start and supervise the services listed in MANIFEST, one\n\
+                  per line as NAME [OPTIONS] CMD [ARG]..., where OPTIONS\n\
+                  are any of -c, -C, -d, -f, -g, -G, -I, -l, -L, -N, -p,\n\
+                  -r, -R, -S, -u, -w and -z, with -D NAME to start after\n\
+                  service NAME is ready\n\
+  -n LIMIT:SRC  allow no more than LIMIT concurrent socket connections,\n\
+                  counted separately by each -j shard, and optionally\n\
+                  no more than SRC from one TCP address or unix uid\n\
+  -N NICE       run the command with nice value NICE\n\
+  -o STATUS     with -r, or when serving sockets, keep the file STATUS\n\
+                  atomically updated with restart and exit details of\n\
+                  the command, or with connection counts\n\
   -p PIDFILE    lock PIDFILE and write pid to it, removing it on exit\n\
+  -P MIN:MAX    instead of a handler per connection, keep between MIN\n\
+                  and MAX long-lived workers, each given the listening\n\
+                  socket as stdin to accept from, as with inetd wait mode\n\
   -r            supervise the running command, restarting it if it dies\n\
                   and passing on TERM, INT, HUP, USR1 and USR2 signals\n\
+  -R FD         give the command a pipe on FD to write a newline to when\n\
+                  it is ready, and only then move PIDFILE into place\n\
   -s PATH       listen on a unix stream socket and run the command with\n\
                   stdin and stdout attached to each connection\n\
+  -S POLICY:PRI set scheduling policy other, batch, idle, fifo or rr,\n\
+                  with a static priority PRI for fifo and rr\n\
   -t HOST:PORT  listen on a TCP stream socket and run the command with\n\
                   stdin and stdout attached to each connection\n\
+  -T TIMELINE   append events with CLOCK_BOOTTIME timestamps to the file\n\
+                  TIMELINE as the command waits for paths, is spawned,\n\
+                  becomes ready and exits, for use with daemonchart\n\
   -u UID:GID    run the command with the specified numeric uid and gid\n\
   -u USERNAME   run the command with the uid and gid of user USERNAME\n\
   -w PATH       wait until PATH exists before running the command\n\
+  -W TIMEOUT    give up if -w paths do not all exist within TIMEOUT secs\n\
+  -z SIZE:COUNT with -l LOGFILE, timestamp and buffer each line, rotating\n\
+                  the file at SIZE bytes, with an optional k, M or G\n\
+                  suffix, and keeping COUNT old files, 1 by default\n\
 ", progname);
   exit(64);
 }
 
 int main(int argc, char **argv) {
-  char *dir = NULL, *options, *path;
-  int fd, inotify, option, pwd, tail, waitargs;
-  size_t limit = -1, restart = 0, session = 1;
-  struct passwd *user;
+  char *dir = NULL, *end, *manifest = NULL, *options, *path = NULL;
+  char *status = NULL;
+  double timeout = -1;
+  int binds = 0, delays = 0, fd, option, settings = 0, tail, tcp = 0;
+  int waitargs;
+  size_t limit = -1, persource = -1, restart = 0, serving = 0;
+  size_t session = 1;
+  size_t workers[2] = { 0, 0 };
 
   /* Redirect stdin from /dev/null. */
   if ((fd = open("/dev/null", O_RDWR)) < 0)
@@ -509,9 +2664,23 @@ int main(int argc, char **argv) {
     if ((dup2(STDIN_FILENO, STDERR_FILENO)) < 0)
       err(EXIT_FAILURE, "dup2");
 
-  options = "+:cd:fl:n:p:rs:t:u:w:", waitargs = 0;
+  options = "+:ab:cd:e:fg:j:l:m:n:o:p:rR:s:t:u:w:z:C:G:I:L:N:P:S:T:W:";
+  waitargs = 0;
   while ((option = getopt(argc, argv, options)) > 0)
     switch (option) {
+      case 'a':
+        activate = 1;
+        break;
+      case 'b':
+        backoff.min = strtod(optarg, &end);
+        if (*end == ':')
+          backoff.max = strtod(end + 1, &end);
+        else if (backoff.max < backoff.min)
+          backoff.max = backoff.min;
+        delays = 1;
+        if (*end || !(backoff.min >= 0) || !(backoff.max >= backoff.min))
+          errx(EXIT_FAILURE, "Invalid restart backoff");
+        break;
       case 'c':
         /* Special case of -d DIR, for compatibility with BSD daemon(1). */
         dir = "/";
@@ -522,42 +2691,107 @@ int main(int argc, char **argv) {
           err(EXIT_FAILURE, "%s", dir);
         close(fd);
         break;
+      case 'e':
+        expiry.life = strtod(optarg, &end);
+        if (*end == ':')
+          expiry.idle = strtod(end + 1, &end);
+        if (*end || !(expiry.life >= 0) || !(expiry.idle >= 0))
+          errx(EXIT_FAILURE, "Invalid connection timeout");
+        break;
       case 'f':
         session = 0;
         break;
+      case 'g':
+        if (cgroup >= 0)
+          close(cgroup);
+        cgroup = cgroup_open(optarg);
+        break;
+      case 'G':
+        settings++;
+        break;
+      case 'j':
+        if (strcmp(optarg, "cpu") == 0) {
+          shards = sysconf(_SC_NPROCESSORS_ONLN) > 0 ?
+            sysconf(_SC_NPROCESSORS_ONLN) : 1;
+          steer = shards > 1;
+          break;
+        }
+        /* Unlike sscanf(), this rejects a sign and an out-of-range count. */
+        errno = 0;
+        shards = strtoul(optarg, &end, 10);
+        if (*optarg >= '0' && *optarg <= '9' && *end == 0)
+          if (errno == 0 && shards > 0)
+            break;
+        errx(EXIT_FAILURE, "Invalid shard count");
       case 'l':
-        logger_setup(optarg);
+        logger_setup(&logger, optarg);
+        break;
+      case 'm':
+        manifest = optarg;
         break;
       case 'n':
-        if (sscanf(optarg, "%zu%n", &limit, &tail) >= 1)
-          if (optarg[tail] == 0)
-            break;
-        errx(EXIT_FAILURE, "Invalid connection limit");
+        limit = strtoul(optarg, &end, 10);
+        if (end > optarg && *end == ':' && end[1] >= '0' && end[1] <= '9')
+          persource = strtoul(end + 1, &end, 10);
+        if (end == optarg || *end)
+          errx(EXIT_FAILURE, "Invalid connection limit");
+        break;
+      case 'o':
+        status = optarg;
+        break;
       case 'p':
-        pidfile_open(optarg);
+        if (path)
+          errx(EXIT_FAILURE, "-p cannot be specified more than once");
+        path = optarg;
+        break;
+      case 'P':
+        workers[0] = workers[1] = strtoul(optarg, &end, 10);
+        if (end > optarg && *end == ':' && end[1] >= '0' && end[1] <= '9')
+          workers[1] = strtoul(end + 1, &end, 10);
+        if (*end || workers[0] == 0 || workers[1] < workers[0])
+          errx(EXIT_FAILURE, "Invalid worker pool size");
         break;
       case 'r':
         restart = 1;
         break;
+      case 'R':
+        if (sscanf(optarg, "%d%n", &notify, &tail) >= 1)
+          if (optarg[tail] == 0 && notify > STDERR_FILENO)
+            break;
+        errx(EXIT_FAILURE, "Invalid notification fd");
       case 's':
-        listen_unix(optarg);
-        break;
       case 't':
-        listen_tcp(optarg);
+        tcp += option == 't';
+        binds++;
+        break;
+      case 'T':
+        timeline.fd = open(optarg, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC,
+          0644);
+        if (timeline.fd < 0)
+          err(EXIT_FAILURE, "%s", optarg);
         break;
       case 'u':
-        if (sscanf(optarg, "%u:%u%n", &uid, &gid, &tail) >= 2)
-          if (optarg[tail] == 0)
-            break;
-        if ((user = getpwnam(optarg))) {
-          uid = user->pw_uid;
-          gid = user->pw_gid;
-          break;
-        }
-        errx(EXIT_FAILURE, "Invalid username");
+        credentials(optarg, &uid, &gid);
+        break;
       case 'w':
         waitargs++;
         break;
+      case 'W':
+        timeout = strtod(optarg, &end);
+        if (!*optarg || *end || !(timeout >= 0))
+          errx(EXIT_FAILURE, "Invalid timeout");
+        waitargs++;
+        break;
+      case 'z':
+        logger_limit(&logger, optarg);
+        break;
+      case 'C':
+      case 'I':
+      case 'L':
+      case 'N':
+      case 'S':
+        tune(&tuning, option, optarg);
+        break;
       default:
         usage(argv[0]);
     }
@@ -566,8 +2800,69 @@ int main(int argc, char **argv) {
   if (waitargs > 0 && argc == 2 * waitargs + 1)
     goto await;
 
-  if (argc <= optind)
+  if (binds > 0) {
+    optind = 0; /* Need to reset optind to bind after reading -j. */
+    while ((option = getopt(argc, argv, options)) > 0)
+      if (option == 's')
+        listen_unix(optarg);
+      else if (option == 't')
+        listen_tcp(optarg);
+  }
+
+  /* Shards each run their own serve() loop on a copy of the TCP sockets. */
+  if (shards > 1 && (tcp == 0 || workers[0] > 0))
+    usage(argv[0]);
+
+  /* Restart delays only apply to a supervisor or a worker pool. */
+  if (delays && !restart && workers[0] == 0)
+    usage(argv[0]);
+
+  /* A worker pool shares a single listening socket as stdin. */
+  if (workers[0] > 0 && (listeners != 1 || activate))
+    usage(argv[0]);
+
+  /* With -a, listeners are handed to the command instead of served. */
+  if (activate && (listeners == 0 || manifest))
+    usage(argv[0]);
+  if (activate && notify >= 0 && (size_t) notify < 3 + listeners)
+    errx(EXIT_FAILURE, "Notification fd clashes with passed listeners");
+  serving = listeners > 0 && !activate;
+
+  /* Services in a manifest each take their own -g and -G options. */
+  if ((settings && cgroup < 0) || (cgroup >= 0 && manifest))
+    usage(argv[0]);
+  if (settings > 0) {
+    optind = 0; /* Need to reset optind to reprocess -G arguments. */
+    while ((option = getopt(argc, argv, options)) > 0)
+      if (option == 'G')
+        cgroup_set(cgroup, optarg);
+  }
+
+  /* Log rotation only makes sense when logging to a file. */
+  if (logger.output && logger.file < 0)
+    usage(argv[0]);
+
+  /* Readiness is marked by moving the pidfile into place. */
+  if (notify >= 0 && (serving || manifest || !path))
+    usage(argv[0]);
+  if (path)
+    pidfile_open(path);
+
+  /* Only a supervising or serving daemon has a status to publish. */
+  if (status && (manifest || workers[0] > 0 || (!restart && !serving)))
+    usage(argv[0]);
+  if (status)
+    statusfile_open(status);
+
+  /* Load the manifest early so errors are reported in the foreground. */
+  if (manifest) {
+    if (argc > optind || restart || listeners)
+      usage(argv[0]);
+    manifest_load(manifest);
+    manifest_link();
+  } else if (argc <= optind) {
     usage(argv[0]);
+  }
 
   /* Fork into the background then create a session and process group. */
   switch (fork()) {
@@ -580,7 +2875,7 @@ int main(int argc, char **argv) {
       _exit(EXIT_SUCCESS); /* Don't delete pidfile in atexit() handler. */
   }
 
-  if (!session && !restart && !listeners) {
+  if (!session && !restart && !serving) {
     /* Fork again to ensure we are not the session leader. */
     switch (fork()) {
       case -1:
@@ -592,43 +2887,44 @@ int main(int argc, char **argv) {
     }
   }
 
-  logger_start();
+  logger_start(!restart && !serving && !manifest);
   pidfile_write();
+  statusfile.owner = getpid();
+  statusfile.started = time(NULL);
+  if (argc > optind) {
+    end = strrchr(argv[optind], '/');
+    if (asprintf(&timeline.name, "%s:%d", end ? end + 1 : argv[optind],
+          getpid()) < 0)
+      err(EXIT_FAILURE, "asprintf");
+  }
 
 await:
   if (waitargs > 0) {
-    if ((inotify = inotify_init1(IN_CLOEXEC | IN_NONBLOCK)) < 0)
-      err(EXIT_FAILURE, "inotify_init1");
-
-    /* Open the working directory so we can restore it after each await(). */
-    if ((pwd = open(".", O_RDONLY | O_DIRECTORY)) < 0)
-      err(EXIT_FAILURE, "open pwd");
-
     optind = 0; /* Need to reset optind to reprocess -w arguments. */
     while ((option = getopt(argc, argv, options)) > 0)
-      if (option == 'w') {
-        if (!(path = strdup(optarg)))
-          err(EXIT_FAILURE, "strdup");
-        await(path, inotify, 0);
-        free(path);
-        if (fchdir(pwd) < 0)
-          err(EXIT_FAILURE, "fchdir");
-      }
-
-    close(inotify);
-    close(pwd);
+      if (option == 'w' && await_add(optarg, 0))
+        timeline_add(NULL, "wait %s", optarg);
+    await_all(timeout);
   }
 
   /* Exit if we were just awaiting paths in the foreground. */
-  if (argc <= optind)
+  if (argc <= optind && !manifest)
     return EXIT_SUCCESS;
 
   if (dir && chdir(dir) < 0)
     err(EXIT_FAILURE, "chdir");
 
   /* If we don't need to supervise it, just exec the command. */
-  if (!restart && !listeners)
+  if (!restart && !serving && !manifest) {
+    if (cgroup >= 0 && cgroup_write(cgroup, "cgroup.procs", "0") < 0)
+      err(EXIT_FAILURE, "cgroup.procs");
+    if (notify >= 0)
+      notify_helper();
+    if (activate)
+      listen_pass();
+    timeline_add(NULL, "spawn %d", getpid());
     execute(argv + optind);
+  }
 
   /* Use a signals pipe to avoid async-unsafe handlers. */
   if (pipe2(signals, O_CLOEXEC) < 0)
@@ -644,7 +2940,23 @@ await:
   signal(SIGUSR1, signal_put);
   signal(SIGUSR2, signal_put);
 
-  if (listeners > 0)
-    return serve(argv + optind, limit);
+  if (manifest)
+    return manage();
+  if (workers[0] > 0)
+    return prefork(argv + optind, workers[0], workers[1]);
+  if (serving) {
+    stats = mmap(NULL, shards * sizeof(struct stats), PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (stats == MAP_FAILED)
+      err(EXIT_FAILURE, "mmap");
+  }
+  statusfile_write();
+
+  if (serving)
+    timeline_add(NULL, "ready");
+  if (serving && shards > 1)
+    return shard_serve(argv + optind, limit, persource);
+  if (serving)
+    return serve(argv + optind, limit, persource);
   return supervise(argv + optind, session);
 }
@@ -2,6 +2,9 @@
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -10,6 +13,28 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/syscall.h>
+#include <sys/utsname.h>
+
+#define BUCKETS 16384
+
+static struct alias {
+  char *pattern, *module;
+  struct alias *next;
+} *aliases[BUCKETS], *requests[BUCKETS];
+
+static struct module {
+  char *name, *path, *deps;
+  int state;
+  struct module *next;
+} *modules[BUCKETS];
+
+static struct node {
+  struct alias *aliases;
+  struct node *child, *sibling;
+  char label;
+} trie;
+
+static int flags;
 
 static int getfile(char *filename) {
   ssize_t chunk, offset, size;
@@ -45,20 +70,265 @@ static int getfile(char *filename) {
   return memfd;
 }
 
+static uint32_t hash(char *key, size_t length) {
+  uint32_t hash = 2166136261;
+
+  while (length--)
+    hash = (hash ^ (unsigned char) *key++) * 16777619;
+  return hash;
+}
+
+static char *readfile(int dir, char *filename) {
+  char *buffer = NULL;
+  size_t length = 0, size = 0;
+  ssize_t count;
+  int fd;
+
+  if ((fd = openat(dir, filename, O_RDONLY | O_CLOEXEC)) < 0)
+    err(EXIT_FAILURE, "open %s", filename);
+
+  while (1) {
+    if (length + BUFSIZ + 1 > size)
+      if (!(buffer = realloc(buffer, size = 2 * size + BUFSIZ + 1)))
+        err(EXIT_FAILURE, "realloc");
+    if ((count = read(fd, buffer + length, size - length - 1)) > 0)
+      length += count;
+    else if (count == 0)
+      break;
+    else if (errno != EAGAIN && errno != EINTR)
+      err(EXIT_FAILURE, "read %s", filename);
+  }
+
+  buffer[length] = 0;
+  close(fd);
+  return buffer;
+}
+
+static size_t modname(char *name, char *path, size_t length) {
+  size_t size;
+
+  /* Strip the directory and any .ko suffix, and treat - the same as _. */
+  for (size = length; size > 0 && path[size - 1] != '/'; size--);
+  path += size, length -= size;
+  for (size = 0; size < length && size < NAME_MAX; size++)
+    if (path[size] == '.' && !strncmp(path + size, ".ko", 3))
+      break;
+    else
+      name[size] = path[size] == '-' ? '_' : path[size];
+  name[size] = 0;
+  return size;
+}
+
+static struct module *module_find(char *name) {
+  struct module *module = modules[hash(name, strlen(name)) % BUCKETS];
+
+  while (module && strcmp(module->name, name))
+    module = module->next;
+  return module;
+}
+
+static void index_aliases(int dir) {
+  char *line, *next, *pattern, *name;
+  struct alias *alias;
+  struct node *node, **link;
+  size_t length;
+
+  for (next = readfile(dir, "modules.alias"); (line = strsep(&next, "\n"));) {
+    if (strncmp(line, "alias ", 6))
+      continue;
+    pattern = line + 6;
+    if (!(name = strchr(pattern, ' ')))
+      continue;
+    *name++ = 0;
+    if (!(alias = malloc(sizeof(struct alias))))
+      err(EXIT_FAILURE, "malloc");
+    *alias = (struct alias) { pattern, name };
+    for (; *name; name++)
+      if (*name == '-')
+        *name = '_';
+
+    /* Exact aliases are hashed, but globs hang off a trie of their prefix. */
+    length = strcspn(pattern, "*?[\\");
+    if (pattern[length] == 0) {
+      alias->next = aliases[hash(pattern, length) % BUCKETS];
+      aliases[hash(pattern, length) % BUCKETS] = alias;
+      continue;
+    }
+
+    for (node = &trie; length--; node = *link) {
+      for (link = &node->child; *link; link = &(*link)->sibling)
+        if ((*link)->label == *pattern)
+          break;
+      if (*link == NULL) {
+        if (!(*link = calloc(1, sizeof(struct node))))
+          err(EXIT_FAILURE, "calloc");
+        (*link)->label = *pattern;
+      }
+      pattern++;
+    }
+    alias->next = node->aliases;
+    node->aliases = alias;
+  }
+}
+
+static void index_modules(int dir) {
+  char *line, *next, *deps, name[NAME_MAX + 1];
+  struct module *module;
+  size_t length;
+
+  for (next = readfile(dir, "modules.dep"); (line = strsep(&next, "\n"));) {
+    if (!(deps = strchr(line, ':')))
+      continue;
+    *deps++ = 0;
+    length = modname(name, line, strlen(line));
+
+    if (!(module = malloc(sizeof(struct module))))
+      err(EXIT_FAILURE, "malloc");
+    *module = (struct module) { strdup(name), line, deps + strspn(deps, " ") };
+    module->next = modules[hash(name, length) % BUCKETS];
+    modules[hash(name, length) % BUCKETS] = module;
+  }
+}
+
+static int load(int dir, struct module *module) {
+  char name[NAME_MAX + 1], path[PATH_MAX], *deps = module->deps;
+  struct module *dep;
+  size_t length;
+  int fd, status = 0;
+
+  if (module->state)
+    return module->state < 0 ? -1 : 0;
+  module->state = 1;
+
+  /* Load each dependency in turn, together with its own dependencies. */
+  while (length = strcspn(deps, " "), length > 0) {
+    modname(name, deps, length);
+    if ((dep = module_find(name)) && load(dir, dep) < 0)
+      status = module->state = -1;
+    deps += length + strspn(deps + length, " ");
+  }
+  if (status < 0)
+    return -1;
+
+  snprintf(path, sizeof(path), "/sys/module/%s", module->name);
+  if (access(path, F_OK) == 0)
+    return 0;
+
+  if ((fd = openat(dir, module->path, O_RDONLY | O_CLOEXEC)) < 0) {
+    warn("open %s", module->path);
+    return module->state = -1;
+  }
+
+#ifdef MODULE_INIT_COMPRESSED_FILE
+  if (strstr(module->path, ".ko."))
+    status = syscall(__NR_finit_module, fd, "",
+      flags | MODULE_INIT_COMPRESSED_FILE);
+  else
+#endif
+    status = syscall(__NR_finit_module, fd, "", flags);
+
+  if (status < 0 && errno != EEXIST) {
+    warn("finit_module %s", module->path);
+    module->state = -1;
+  }
+  close(fd);
+  return module->state < 0 ? -1 : 0;
+}
+
+static int resolve(int dir, char *modalias) {
+  struct alias *alias;
+  struct module *module;
+  struct node *node = &trie;
+  size_t length = strlen(modalias);
+  uint32_t bucket = hash(modalias, length) % BUCKETS;
+  int status = 0;
+
+  /* Each distinct MODALIAS only needs resolving once. */
+  for (alias = requests[bucket]; alias; alias = alias->next)
+    if (!strcmp(alias->pattern, modalias))
+      return 0;
+  if (!(alias = malloc(sizeof(struct alias))))
+    err(EXIT_FAILURE, "malloc");
+  *alias = (struct alias) { strdup(modalias), NULL, requests[bucket] };
+  requests[bucket] = alias;
+
+  for (alias = aliases[bucket]; alias; alias = alias->next)
+    if (!strcmp(alias->pattern, modalias))
+      if ((module = module_find(alias->module)) && load(dir, module) < 0)
+        status = -1;
+
+  /* Globs can only match if their literal prefix is a prefix of MODALIAS. */
+  for (char *prefix = modalias; node; prefix++) {
+    for (alias = node->aliases; alias; alias = alias->next)
+      if (!fnmatch(alias->pattern, modalias, 0))
+        if ((module = module_find(alias->module)) && load(dir, module) < 0)
+          status = -1;
+    for (node = node->child; node; node = node->sibling)
+      if (node->label == *prefix)
+        break;
+  }
+  return status;
+}
+
+static int autoload(char *path, char **modaliases) {
+  char *line = NULL, release[PATH_MAX];
+  int dir, status = EXIT_SUCCESS;
+  struct utsname uts;
+  size_t size = 0;
+  ssize_t length;
+
+  if (path == NULL) {
+    if (uname(&uts) < 0)
+      err(EXIT_FAILURE, "uname");
+    snprintf(release, sizeof(release), "/lib/modules/%s", uts.release);
+    path = release;
+  }
+
+  if ((dir = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+    err(EXIT_FAILURE, "open %s", path);
+  index_aliases(dir);
+  index_modules(dir);
+
+  /* Without arguments, resolve each line of stdin as it arrives. */
+  if (*modaliases) {
+    for (; *modaliases; modaliases++)
+      if (resolve(dir, *modaliases) < 0)
+        status = EXIT_FAILURE;
+    return status;
+  }
+
+  while ((length = getline(&line, &size, stdin)) > 0) {
+    if (line[length - 1] == '\n')
+      line[--length] = 0;
+    if (length > 0 && resolve(dir, line) < 0)
+      status = EXIT_FAILURE;
+  }
+  return status;
+}
+
 static int usage(char *progname) {
   if (strstr(progname, "remove"))
     fprintf(stderr, "Usage: %s MODULE...\n", progname);
   else
-    fprintf(stderr, "Usage: %s MODULE [PARAM]\n", progname);
+    fprintf(stderr, "\
+Usage: %1$s MODULE [PARAM]\n\
+       %1$s -a [-d DIR] [MODALIAS]...\n\
+", progname);
   return 64;
 }
 
 int main(int argc, char **argv) {
-  int flags = 0, force = 0, length = 0, module, option, status;
-  char *params;
+  int alias = 0, force = 0, length = 0, module, option, status;
+  char *dir = NULL, *params;
 
-  while ((option = getopt(argc, argv, ":f")) > 0)
+  while ((option = getopt(argc, argv, ":ad:f")) > 0)
     switch (option) {
+      case 'a':
+        alias = 1;
+        break;
+      case 'd':
+        dir = optarg;
+        break;
       case 'f':
         force = 1;
         break;
@@ -66,7 +336,9 @@ int main(int argc, char **argv) {
         return usage(argv[0]);
     }
 
-  if (optind >= argc)
+  if (alias && strstr(argv[0], "remove"))
+    return usage(argv[0]);
+  if (!alias && (dir || optind >= argc))
     return usage(argv[0]);
 
   if (strstr(argv[0], "remove")) {
@@ -84,6 +356,9 @@ int main(int argc, char **argv) {
     flags |= MODULE_INIT_IGNORE_VERMAGIC;
   }
 
+  if (alias)
+    return autoload(dir, argv + optind);
+
   module = getfile(argv[optind]);
   for (size_t i = optind + 1; i < argc; i++)
     length += strlen(argv[i]) + 1;
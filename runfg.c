@@ -1,44 +1,264 @@
+#define _GNU_SOURCE
 #include <err.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <linux/sched.h>
 #include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/wait.h>
 
+static char *cgroup;
+static int created, dir = -1;
+
+static double monotonic(void) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static void cgroup_open(const char *path) {
+  /* As with daemon -g, paths are relative to /sys/fs/cgroup. */
+  if (asprintf(&cgroup, "%s%s", *path == '/' ? "" : "/sys/fs/cgroup/",
+        path) < 0)
+    err(EXIT_FAILURE, "asprintf");
+  if (mkdir(cgroup, 0755) == 0)
+    created = 1;
+  else if (errno != EEXIST)
+    err(EXIT_FAILURE, "%s", cgroup);
+  if ((dir = open(cgroup, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+    err(EXIT_FAILURE, "%s", cgroup);
+}
+
+static uint64_t cgroup_read(const char *file, const char *key) {
+  char buffer[4096], *cursor;
+  uint64_t total = 0;
+  ssize_t length;
+  int fd;
+
+  if ((fd = openat(dir, file, O_RDONLY | O_CLOEXEC)) < 0)
+    return 0;
+  length = read(fd, buffer, sizeof(buffer) - 1);
+  close(fd);
+  if (length <= 0)
+    return 0;
+  buffer[length] = 0;
+
+  /* Sum KEY=VALUE or KEY VALUE fields, or read a bare number. */
+  if (key == NULL)
+    return strtoull(buffer, NULL, 10);
+  for (cursor = buffer; (cursor = strstr(cursor, key)); cursor++)
+    if (cursor == buffer || cursor[-1] == ' ' || cursor[-1] == '\n')
+      total += strtoull(cursor + strlen(key), NULL, 10);
+  return total;
+}
+
+static int cgroup_kill(void) {
+  int fd, status;
+
+  if (dir < 0 || (fd = openat(dir, "cgroup.kill", O_WRONLY)) < 0)
+    return -1;
+  status = write(fd, "1", 1);
+  close(fd);
+  return status < 0 ? -1 : 0;
+}
+
+static void kill_tree(pid_t pid) {
+  char path[64];
+  FILE *children;
+  pid_t child;
+
+  /* Stop each child before its own children so none can fork away. */
+  snprintf(path, sizeof(path), "/proc/%d/task/%d/children", pid, pid);
+  if ((children = fopen(path, "re"))) {
+    while (fscanf(children, "%d", &child) == 1) {
+      kill(child, SIGSTOP);
+      kill_tree(child);
+      kill(child, SIGKILL);
+    }
+    fclose(children);
+  }
+}
+
+static pid_t spawn(void) {
+  struct clone_args args = {
+    .flags = CLONE_INTO_CGROUP,
+    .exit_signal = SIGCHLD,
+    .cgroup = dir
+  };
+  pid_t pid;
+
+  if (dir >= 0) {
+    pid = syscall(SYS_clone3, &args, sizeof(args));
+    if (pid >= 0 || (errno != ENOSYS && errno != E2BIG && errno != EINVAL))
+      return pid;
+  }
+
+  /* Without CLONE_INTO_CGROUP, the child moves itself after fork(). */
+  if ((pid = fork()) == 0 && dir >= 0) {
+    int fd = openat(dir, "cgroup.procs", O_WRONLY | O_CLOEXEC);
+    if (fd < 0 || write(fd, "0", 1) < 0)
+      err(EXIT_FAILURE, "%s/cgroup.procs", cgroup);
+    close(fd);
+  }
+  return pid;
+}
+
+static void summary(double elapsed, size_t reaped) {
+  struct rusage usage;
+
+  /* Every descendant is reaped by its parent or by us as subreaper. */
+  getrusage(RUSAGE_CHILDREN, &usage);
+  fprintf(stderr, "%s: %.3fs real, %.3fs user, %.3fs sys, "
+    "%ld KiB peak RSS, %ld KiB read, %ld KiB written, %zu reaped\n",
+    program_invocation_short_name, elapsed,
+    usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6,
+    usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6,
+    usage.ru_maxrss, usage.ru_inblock / 2, usage.ru_oublock / 2, reaped);
+
+  if (dir >= 0)
+    fprintf(stderr, "%s: cgroup %.3fs cpu, %llu KiB peak memory, "
+      "%llu KiB read, %llu KiB written, %llu peak pids\n",
+      program_invocation_short_name,
+      cgroup_read("cpu.stat", "usage_usec") / 1e6,
+      (unsigned long long) cgroup_read("memory.peak", NULL) >> 10,
+      (unsigned long long) cgroup_read("io.stat", "rbytes=") >> 10,
+      (unsigned long long) cgroup_read("io.stat", "wbytes=") >> 10,
+      (unsigned long long) cgroup_read("pids.peak", NULL));
+}
+
+static void usage(char *progname) {
+  fprintf(stderr, "\
+Usage: %s [OPTIONS] CMD [ARG]...\n\
+Options:\n\
+  -c CGROUP     run the command in cgroup CGROUP, created if necessary,\n\
+                  relative to /sys/fs/cgroup unless given as an absolute\n\
+                  path, and removed afterwards if it was created\n\
+  -s            report CPU time, peak memory, I/O and processes reaped\n\
+                  for the whole tree, and cgroup totals with -c\n\
+  -t TIMEOUT    kill the command and all its descendants if they have not\n\
+                  all exited within TIMEOUT seconds\n\
+", progname);
+  exit(64);
+}
+
 int main(int argc, char **argv) {
-  int result = EXIT_FAILURE, status;
+  double deadline = 0, remaining, started, timeout = -1;
+  int delay, option, pidfd, report = 0, result = EXIT_FAILURE, status;
+  size_t reaped = 0;
   pid_t child, command;
+  struct pollfd fds[2];
+  char *end, *path = NULL;
+  sigset_t mask;
 
-  if (argc < 2) {
-    fprintf(stderr, "Usage: %s CMD [ARG]...\n", argv[0]);
-    return 64;
-  }
+  while ((option = getopt(argc, argv, "+:c:st:")) > 0)
+    switch (option) {
+      case 'c':
+        path = optarg;
+        break;
+      case 's':
+        report = 1;
+        break;
+      case 't':
+        timeout = strtod(optarg, &end);
+        if (!*optarg || *end || !(timeout >= 0))
+          errx(EXIT_FAILURE, "Invalid timeout");
+        break;
+      default:
+        usage(argv[0]);
+    }
+
+  if (argc <= optind)
+    usage(argv[0]);
+  if (path)
+    cgroup_open(path);
 
   if (prctl(PR_SET_CHILD_SUBREAPER, 1L, 0L, 0L, 0L) < 0)
     err(EXIT_FAILURE, "prctl PR_SET_CHILD_SUBREAPER");
 
-  switch (command = fork()) {
+  /* Take SIGCHLD through a signalfd so we can wait with a deadline. */
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &mask, NULL);
+  if ((fds[0].fd = signalfd(-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK)) < 0)
+    err(EXIT_FAILURE, "signalfd");
+  fds[0].events = POLLIN;
+
+  started = monotonic();
+  if (timeout >= 0)
+    deadline = started + timeout;
+
+  switch (command = spawn()) {
     case -1:
       err(EXIT_FAILURE, "fork");
     case 0:
-      execvp(argv[1], argv + 1);
-      err(EXIT_FAILURE, "exec %s", argv[1]);
+      sigprocmask(SIG_UNBLOCK, &mask, NULL);
+      execvp(argv[optind], argv + optind);
+      err(EXIT_FAILURE, "exec %s", argv[optind]);
   }
 
+  /* The command's pidfd lets us signal it without a pid reuse race. */
+  pidfd = syscall(SYS_pidfd_open, command, 0);
+  fds[1].fd = pidfd;
+  fds[1].events = POLLIN;
+
   while (1) {
-    child = waitpid(-1, &status, 0);
-    if (child < 0) {
-      if (errno == ECHILD)
-        return result;
-      if (errno != EINTR)
-        err(EXIT_FAILURE, "waitpid");
-    } else if (child == command) {
-      if (WIFEXITED(status))
-        result = WEXITSTATUS(status);
-      if (WIFSIGNALED(status))
-        result = 128 + WTERMSIG(status);
-      command = -1;
+    while ((child = waitpid(-1, &status, WNOHANG)) > 0) {
+      reaped++;
+      if (child == command) {
+        if (WIFEXITED(status))
+          result = WEXITSTATUS(status);
+        if (WIFSIGNALED(status))
+          result = 128 + WTERMSIG(status);
+        if (pidfd >= 0)
+          close(pidfd);
+        command = -1;
+        fds[1].fd = pidfd = -1;
+      }
     }
+    if (child < 0 && errno == ECHILD)
+      break;
+    if (child < 0 && errno != EINTR)
+      err(EXIT_FAILURE, "waitpid");
+
+    /* On timeout, kill the cgroup or everything we can reach below us. */
+    if (deadline > 0 && monotonic() >= deadline) {
+      warnx("Timed out after %gs", timeout);
+      deadline = 0;
+      if (pidfd >= 0)
+        syscall(SYS_pidfd_send_signal, pidfd, SIGKILL, NULL, 0);
+      if (cgroup_kill() < 0)
+        kill_tree(getpid());
+    }
+
+    /* Wake at least once a minute so a long timeout cannot overflow. */
+    delay = -1;
+    if (deadline > 0) {
+      remaining = deadline - monotonic();
+      delay = remaining <= 0 ? 0 : remaining < 60 ? 1 + 1000 * remaining
+        : 60000;
+    }
+    if (poll(fds, 2, delay) < 0 && errno != EINTR)
+      err(EXIT_FAILURE, "poll");
+    while (read(fds[0].fd, &(struct signalfd_siginfo) { 0 },
+        sizeof(struct signalfd_siginfo)) > 0)
+      continue;
   }
+
+  if (report)
+    summary(monotonic() - started, reaped);
+  if (created && rmdir(cgroup) < 0)
+    warn("rmdir %s", cgroup);
+  return result;
 }
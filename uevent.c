@@ -1,22 +1,124 @@
+#define _GNU_SOURCE
+#include <dirent.h>
 #include <err.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <poll.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <asm/types.h>
 #include <linux/netlink.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 
+#define BATCH 64
 #define BUFFER 4096
+#define DEVICES 4096
+#define REPLAY 1024
+
+#ifndef FNM_EXTMATCH
+#define FNM_EXTMATCH 0
+#endif
 
 static struct sockaddr_nl netlink = { .nl_family = AF_NETLINK };
 
-static int broadcast(void) {
-  char *action = NULL, *devpath = NULL, *event = NULL, *line = NULL;
-  size_t length = 0, linesize = 0, size = 0;
-  int sock, socksize = 1 << 21;
+static struct client {
+  char *filters;
+  size_t length;
+  int overflow, subscribed;
+} *clients;
+
+static struct uevent {
+  char *event;
+  size_t length;
+  unsigned long long seqnum;
+} replay[REPLAY];
+
+static struct device {
+  char *event;
+  size_t length;
+  struct device *next;
+} *devices[DEVICES];
+
+/*
+ * The device database file is this header, then each device as a 32-bit
+ * length and a null-padded add event, then a bucket array and a list of
+ * entries for each index. An entry holds the file offset of a device and
+ * the number of the next entry in its chain. Buckets and chains use 1-based
+ * entry numbers, with 0 marking the end of a chain.
+ *
+ * Later changes are appended from offset journal as a journal of records,
+ * each a 64-bit SEQNUM, a 32-bit length and an add event or a bare
+ * remove@DEVPATH header, null-padded to eight bytes. The latest record for
+ * a DEVPATH overrides any earlier entry. A record with SEQNUM 0 belongs
+ * with the record after it, as a move is a remove and an add.
+ */
+
+static struct database {
+  char magic[8];
+  uint64_t seqnum;
+  uint32_t count, buckets;
+  uint32_t index[4][2];
+  uint32_t journal, unused;
+} database = { .magic = "uevent2" };
+
+static struct change {
+  uint32_t hash, offset;
+} *changes;
+
+/*
+ * A recording is an eight-byte magic then each uevent as a 64-bit monotonic
+ * timestamp in nanoseconds, a 64-bit length and the raw netlink message.
+ */
+
+static const char magic[8] = "urecord";
+
+static struct group {
+  char filters[BUFFER];
+  size_t length;
+  int matched;
+} *groups;
+
+static char *dbfile, *indexes[] = {
+  "DEVPATH", "DEVNAME", "SUBSYSTEM", "MODALIAS"
+};
+static char overflow[] = "overflow@\0ACTION=overflow";
+static struct pollfd *pollfd;
+static size_t grouped, polled, replayed, stored, unmatched;
+static char *journal;
+static int dbfd = -1, dirty, recording = -1;
+static size_t changed, journaled, journal_size;
+static uint64_t dbend, horizon, latest;
+
+static size_t flush(int sock, struct mmsghdr *messages, size_t count) {
+  ssize_t sent;
+
+  /* Attempt to broadcast uevents but tolerate failures, skipping them. */
+  for (size_t i = 0; i < count; i += sent)
+    if ((sent = sendmmsg(sock, messages + i, count - i, 0)) < 0)
+      sent = errno != EAGAIN && errno != EINTR;
+  return 0;
+}
+
+static int broadcast(char delimiter) {
+  static char input[BATCH * BUFFER + 2], headers[BATCH][BUFFER];
+  static struct iovec iovecs[BATCH][2];
+  static struct mmsghdr messages[BATCH];
+  size_t action = 0, devpath = 0, length = 0, line, position = 0, queued = 0;
+  size_t start = 0;
+  int discard = 0, header, sock, socksize = 1 << 21;
   ssize_t count;
+  char *end;
 
   if ((sock = socket(PF_NETLINK, SOCK_DGRAM, NETLINK_KOBJECT_UEVENT)) < 0)
     err(EXIT_FAILURE, "socket");
@@ -27,88 +129,1150 @@ static int broadcast(void) {
   if (connect(sock, (struct sockaddr *) &netlink, sizeof(netlink)) < 0)
     err(EXIT_FAILURE, "connect");
 
-  while ((count = getline(&line, &linesize, stdin)) > 0 || length) {
-    if (line && count > 0 && line[count - 1] == '\n')
-      count--;
-
-    if (line && count > 0) {
-      /* Append property line and null-terminate it. */
-      while (size < length + count + 1)
-        if (event = realloc(event, size += 4096), event == NULL)
-          err(EXIT_FAILURE, "realloc");
-      memcpy(event + length, line, count);
-      event[length + count] = 0;
-
-      /* Support both KEY VALUE and KEY=VALUE input lines. */
-      for (size_t i = length; i < length + count; i++)
-        if (event[i] == ' ' || event[i] == '=') {
-          event[i] = '=';
+  /* Headers go in their own iovec so records are sent from where they lie. */
+  for (size_t i = 0; i < BATCH; i++) {
+    messages[i].msg_hdr.msg_iov = iovecs[i];
+    messages[i].msg_hdr.msg_iovlen = 2;
+    iovecs[i][0].iov_base = headers[i];
+  }
+
+  while (1) {
+    count = read(STDIN_FILENO, input + length, sizeof(input) - length - 2);
+    if (count < 0) {
+      if (errno != EAGAIN && errno != EINTR)
+        err(EXIT_FAILURE, "read");
+      /* Wait for more input if stdin turns out to be nonblocking. */
+      if (errno == EAGAIN)
+        poll(&(struct pollfd) { STDIN_FILENO, POLLIN, 0 }, 1, -1);
+      continue;
+    }
+
+    /* At the end of input, terminate any trailing line and record. */
+    length += count;
+    if (count == 0 && position < length)
+      input[length++] = delimiter;
+    if (count == 0 && start < length)
+      input[length++] = delimiter;
+
+    while ((end = memchr(input + position, delimiter, length - position))) {
+      line = position, position = end - input + 1, *end = 0;
+
+      /* An empty line completes the record, which is queued to send
+         unless its ACTION@DEVPATH header is too long to fit. */
+      if (end == input + line) {
+        if (line > start && action && devpath && !discard
+            && (header = snprintf(headers[queued], BUFFER, "%s@%s",
+              input + action, input + devpath)) < BUFFER) {
+          iovecs[queued][0].iov_len = header + 1;
+          iovecs[queued][1].iov_base = input + start;
+          iovecs[queued][1].iov_len = line - start;
+          if (++queued == BATCH)
+            queued = flush(sock, messages, queued);
+        }
+        action = devpath = discard = 0, start = position;
+        continue;
+      }
+
+      /* Support both KEY VALUE and KEY=VALUE lines, converting in place. */
+      if (input[line + strcspn(input + line, " =")])
+        input[line + strcspn(input + line, " =")] = '=';
+      if (strncmp(input + line, "ACTION=", strlen("ACTION=")) == 0)
+        action = line + strlen("ACTION=");
+      if (strncmp(input + line, "DEVPATH=", strlen("DEVPATH=")) == 0)
+        devpath = line + strlen("DEVPATH=");
+    }
+
+    /* Send everything queued before blocking or reusing the buffer. */
+    queued = flush(sock, messages, queued);
+
+    /* Drop a record too long to ever fit, until its terminating line. */
+    if (start == 0 && length == sizeof(input) - 2)
+      action = devpath = 0, discard = 1, start = position = length;
+
+    memmove(input, input + start, length - start);
+    action -= action ? start : 0, devpath -= devpath ? start : 0;
+    length -= start, position -= start, start = 0;
+
+    if (count == 0)
+      break;
+  }
+
+  close(sock);
+  return EXIT_SUCCESS;
+}
+
+static void print(char *buffer, size_t length) {
+  char *cursor, *separator;
+
+  /* Null-terminate the uevent and replace stray newlines with spaces. */
+  buffer[length] = 0;
+  for (cursor = buffer; cursor < buffer + length; cursor++)
+    if (*cursor == '\n')
+      *cursor = ' ';
+
+  if (strlen(buffer) >= length - 1) {
+    /* No properties; fake a simple environment based on the header. */
+    if ((cursor = strchr(buffer, '@'))) {
+      *cursor++ = 0;
+      printf("ACTION %s\n", buffer);
+      printf("DEVPATH %s\n", cursor);
+    }
+  } else {
+    /* Ignore header as properties will include ACTION and DEVPATH. */
+    cursor = buffer;
+    while (cursor += strlen(cursor) + 1, cursor < buffer + length) {
+      if ((separator = strchr(cursor, '=')))
+        *separator = ' ';
+      puts(cursor);
+    }
+  }
+  putchar('\n');
+  fflush(stdout);
+}
+
+static char *property(char *event, size_t length, char *key, size_t size) {
+  char *cursor = event;
+
+  /* Skip the ACTION@DEVPATH header then look for KEY=VALUE. */
+  while (cursor += strlen(cursor) + 1, cursor < event + length)
+    if (strncmp(cursor, key, size) == 0 && cursor[size] == '=')
+      return cursor + size + 1;
+  return NULL;
+}
+
+static int match(char *event, size_t length, char *filters, size_t size) {
+  char *filter, *pattern, *value;
+
+  /* Every KEY=PATTERN must match, with missing properties taken as empty. */
+  for (filter = filters; filter < filters + size; filter = pattern) {
+    pattern = strchr(filter, '=') + 1;
+    value = property(event, length, filter, pattern - filter - 1);
+    if (fnmatch(pattern, value ? value : "", FNM_EXTMATCH))
+      return 0;
+    pattern += strlen(pattern) + 1;
+  }
+  return 1;
+}
+
+static void serve_drop(size_t index) {
+  close(pollfd[index].fd);
+  free(clients[index].filters);
+  pollfd[index] = pollfd[--polled];
+  clients[index] = clients[polled];
+}
+
+static void serve_send(size_t index, char *event, size_t length) {
+  struct client *client = clients + index;
+
+  /* Report a pending overflow before any further events. */
+  if (client->overflow) {
+    if (send(pollfd[index].fd, overflow, sizeof(overflow), 0) < 0)
+      return;
+    client->overflow = 0;
+    pollfd[index].events &= ~POLLOUT;
+  }
+
+  /* Retry the overflow report as soon as the client has room for it. */
+  if (event && send(pollfd[index].fd, event, length, 0) < 0) {
+    client->overflow = 1;
+    pollfd[index].events |= POLLOUT;
+  }
+}
+
+static void serve_accept(int listener) {
+  int fd;
+
+  if ((fd = accept4(listener, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK)) < 0)
+    return;
+
+  if ((polled & 15) == 0) {
+    pollfd = realloc(pollfd, (polled + 16) * sizeof(struct pollfd));
+    clients = realloc(clients, (polled + 16) * sizeof(struct client));
+    if (pollfd == NULL || clients == NULL)
+      err(EXIT_FAILURE, "realloc");
+  }
+
+  pollfd[polled] = (struct pollfd) { .fd = fd, .events = POLLIN };
+  clients[polled++] = (struct client) { 0 };
+}
+
+static void serve_subscribe(size_t index) {
+  char buffer[BUFFER + 1], *cursor, *tail;
+  struct client *client = clients + index;
+  struct uevent *slot;
+  unsigned long long seqnum;
+  ssize_t length;
+
+  /* Clients send nothing after their subscription, so drop them. */
+  if (client->subscribed)
+    goto drop;
+
+  /* The subscription is SEQNUM followed by KEY=PATTERN filters. */
+  if ((length = recv(pollfd[index].fd, buffer, BUFFER, 0)) <= 0)
+    goto drop;
+  buffer[length] = 0;
+
+  seqnum = strtoull(buffer, &tail, 10);
+  if (*tail != 0 || tail >= buffer + length)
+    goto drop;
+  cursor = tail + 1;
+  for (; cursor < buffer + length; cursor += strlen(cursor) + 1)
+    if (*cursor == '=' || !strchr(cursor, '='))
+      goto drop;
+
+  client->length = buffer + length - tail - 1;
+  if (!(client->filters = malloc(client->length + 1)))
+    err(EXIT_FAILURE, "malloc");
+  memcpy(client->filters, tail + 1, client->length + 1);
+  client->subscribed = 1;
+
+  /* Acknowledge with an empty message, then replay requested events. */
+  if (send(pollfd[index].fd, "", 1, 0) < 0)
+    goto drop;
+  if (*buffer == 0)
+    return;
+
+  /* Events up to the horizon are no longer held, so may have been missed. */
+  if (seqnum < horizon) {
+    client->overflow = 1;
+    serve_send(index, NULL, 0);
+  }
+  for (size_t i = replayed < REPLAY ? 0 : replayed - REPLAY; i < replayed; i++)
+    if ((slot = replay + i % REPLAY)->seqnum > seqnum)
+      if (match(slot->event, slot->length, client->filters, client->length))
+        serve_send(index, slot->event, slot->length);
+  return;
+
+drop:
+  serve_drop(index);
+}
+
+static void serve_event(char *event, size_t length) {
+  char *seqnum = property(event, length, "SEQNUM", strlen("SEQNUM"));
+  struct uevent *slot = replay + replayed++ % REPLAY;
+
+  /* Keep a copy of the event in the replay window, moving the horizon
+     past any event it displaces. */
+  if (slot->event && slot->seqnum > horizon)
+    horizon = slot->seqnum;
+  if (!(slot->event = realloc(slot->event, length + 1)))
+    err(EXIT_FAILURE, "realloc");
+  memcpy(slot->event, event, length + 1);
+  slot->length = length;
+  slot->seqnum = seqnum ? strtoull(seqnum, NULL, 10) : 0;
+
+  for (size_t i = 2; i < polled; i++)
+    if (clients[i].subscribed)
+      if (match(event, length, clients[i].filters, clients[i].length))
+        serve_send(i, event, length);
+}
+
+static void serve_open(int sock, const char *path) {
+  struct sockaddr_un address;
+  size_t length = strlen(path);
+  int fd;
+
+  /* On Linux, address.sun_path is NUL-padded not NUL-terminated. */
+  if (length > sizeof(address.sun_path))
+    errx(EXIT_FAILURE, "Socket path is too long to bind");
+  length += offsetof(struct sockaddr_un, sun_path);
+
+  address.sun_family = AF_UNIX;
+  strncpy(address.sun_path, path, sizeof(address.sun_path));
+  unlink(path);
+
+  fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+  if (fd < 0)
+    err(EXIT_FAILURE, "socket");
+  if (bind(fd, (struct sockaddr *) &address, length) < 0)
+    err(EXIT_FAILURE, "bind %s", path);
+  if (listen(fd, SOMAXCONN) < 0)
+    err(EXIT_FAILURE, "listen");
+
+  /* Slots 0 and 1 hold the netlink socket and the listener. */
+  pollfd = calloc(16, sizeof(struct pollfd));
+  clients = calloc(16, sizeof(struct client));
+  if (pollfd == NULL || clients == NULL)
+    err(EXIT_FAILURE, "calloc");
+  pollfd[0] = (struct pollfd) { .fd = sock, .events = POLLIN };
+  pollfd[1] = (struct pollfd) { .fd = fd, .events = POLLIN };
+  polled = 2;
+}
+
+static uint32_t hash(const char *value) {
+  uint32_t hash = 2166136261;
+
+  /* FNV-1a is simple and spreads short similar strings well enough. */
+  while (*value)
+    hash = (hash ^ (unsigned char) *value++) * 16777619;
+  return hash;
+}
+
+static struct device **device_find(char *devpath) {
+  struct device **device = devices + hash(devpath) % DEVICES;
+
+  /* Stored events are normalised to have an add@DEVPATH header. */
+  while (*device && strcmp((*device)->event + 4, devpath))
+    device = &(*device)->next;
+  return device;
+}
+
+static void device_remove(char *devpath) {
+  struct device **device = device_find(devpath), *next;
+
+  if (*device) {
+    next = (*device)->next;
+    free((*device)->event);
+    free(*device);
+    *device = next;
+    stored--;
+  }
+}
+
+static void device_store(char *event, size_t length) {
+  struct device **device = device_find(event + 4);
+
+  if (*device == NULL) {
+    if (!(*device = calloc(1, sizeof(struct device))))
+      err(EXIT_FAILURE, "calloc");
+    stored++;
+  }
+
+  if (!((*device)->event = realloc((*device)->event, length + 1)))
+    err(EXIT_FAILURE, "realloc");
+  memcpy((*device)->event, event, length + 1);
+  (*device)->length = length;
+}
+
+static void database_scan(int dir, char *devpath) {
+  char event[BUFFER + 1], link[PATH_MAX], *subsystem;
+  size_t length = strlen(devpath), size;
+  struct dirent *entry;
+  ssize_t count;
+  DIR *stream;
+  int fd;
+
+  /* Build an add event from the uevent file if this is a device. */
+  if ((fd = openat(dir, "uevent", O_RDONLY | O_CLOEXEC)) >= 0) {
+    subsystem = "";
+    if ((count = readlinkat(dir, "subsystem", link, sizeof(link) - 1)) > 0) {
+      link[count] = 0;
+      subsystem = strrchr(link, '/') ? strrchr(link, '/') + 1 : link;
+    }
+
+    size = snprintf(event, sizeof(event), "add@%s%cACTION=add%cDEVPATH=%s"
+      "%cSUBSYSTEM=%s%c", devpath, 0, 0, devpath, 0, subsystem, 0);
+    while (size < sizeof(event) - 1)
+      if ((count = read(fd, event + size, sizeof(event) - 1 - size)) > 0)
+        size += count;
+      else if (count == 0 || (errno != EAGAIN && errno != EINTR))
+        break;
+    close(fd);
+
+    /* Properties are newline-terminated, and must fit in a uevent. */
+    if (size < sizeof(event) - 1) {
+      for (size_t i = 0; i < size; i++)
+        if (event[i] == '\n')
+          event[i] = 0;
+      device_store(event, size);
+    }
+  }
+
+  if (!(stream = fdopendir(dir))) {
+    close(dir);
+    return;
+  }
+
+  /* Recurse into subdirectories, skipping the many symlinks in sysfs. */
+  while ((entry = readdir(stream)))
+    if (entry->d_type == DT_DIR && entry->d_name[0] != '.')
+      if (length + strlen(entry->d_name) + 1 < PATH_MAX) {
+        fd = openat(dir, entry->d_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd >= 0) {
+          sprintf(devpath + length, "/%s", entry->d_name);
+          database_scan(fd, devpath);
+          devpath[length] = 0;
+        }
+      }
+  closedir(stream);
+}
+
+static uint64_t kernel_seqnum(void) {
+  char *path, *sysfs = getenv("SYSFS") ?: "/sys";
+  uint64_t value = 0;
+  FILE *seqnum;
+
+  if (asprintf(&path, "%s/kernel/uevent_seqnum", sysfs) < 0)
+    err(EXIT_FAILURE, "asprintf");
+  if ((seqnum = fopen(path, "r"))) {
+    if (fscanf(seqnum, "%" SCNu64, &value) != 1)
+      value = 0;
+    fclose(seqnum);
+  }
+  free(path);
+  return value;
+}
+
+static void database_reset(void) {
+  char devpath[PATH_MAX], *path, *sysfs = getenv("SYSFS") ?: "/sys";
+  int fd;
+
+  for (size_t i = 0; i < DEVICES; i++)
+    while (devices[i])
+      device_remove(devices[i]->event + 4);
+
+  /* Events after the current kernel SEQNUM are not covered by the scan. */
+  database.seqnum = kernel_seqnum();
+
+  if (asprintf(&path, "%s/devices", sysfs) < 0)
+    err(EXIT_FAILURE, "asprintf");
+  if ((fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+    err(EXIT_FAILURE, "%s", path);
+  free(path);
+
+  strcpy(devpath, "/devices");
+  database_scan(fd, devpath);
+  dirty = 1;
+}
+
+static void journal_add(uint64_t seqnum, char *event, size_t length) {
+  uint32_t size = length;
+  size_t total = (sizeof(seqnum) + sizeof(size) + length + 7) & ~7;
+
+  /* Queue a record to append once pending uevents are processed. */
+  if (journaled + total > journal_size) {
+    journal_size = journal_size ? 2 * journal_size + total : 65536;
+    if (!(journal = realloc(journal, journal_size)))
+      err(EXIT_FAILURE, "realloc");
+  }
+  memset(journal + journaled, 0, total);
+  memcpy(journal + journaled, &seqnum, sizeof(seqnum));
+  memcpy(journal + journaled + sizeof(seqnum), &size, sizeof(size));
+  memcpy(journal + journaled + sizeof(seqnum) + sizeof(size), event, length);
+  journaled += total;
+}
+
+static void journal_remove(uint64_t seqnum, char *devpath) {
+  char record[BUFFER];
+  size_t size;
+
+  size = snprintf(record, sizeof(record), "remove@%s", devpath) + 1;
+  if (size <= sizeof(record))
+    journal_add(seqnum, record, size);
+}
+
+static void database_update(char *event, size_t length) {
+  char record[BUFFER + 1], *action, *cursor, *devpath, *value;
+  uint64_t seqnum = 0;
+  size_t size;
+
+  action = property(event, length, "ACTION", strlen("ACTION"));
+  devpath = property(event, length, "DEVPATH", strlen("DEVPATH"));
+  if ((value = property(event, length, "SEQNUM", strlen("SEQNUM"))))
+    database.seqnum = seqnum = strtoull(value, NULL, 10);
+
+  /* Only devices are stored, as only /sys/devices is scanned. */
+  if (action == NULL || devpath == NULL)
+    return;
+  if (strncmp(devpath, "/devices/", strlen("/devices/")))
+    return;
+
+  if (strcmp(action, "remove") == 0) {
+    device_remove(devpath);
+    journal_remove(seqnum, devpath);
+    return;
+  }
+
+  value = property(event, length, "DEVPATH_OLD", strlen("DEVPATH_OLD"));
+  if (strcmp(action, "move") == 0 && value) {
+    device_remove(value);
+    journal_remove(0, value);
+  }
+
+  /* Other actions carry the full property list, so replace the entry. */
+  size = snprintf(record, sizeof(record), "add@%s%cACTION=add", devpath, 0);
+  for (cursor = event; cursor += strlen(cursor) + 1, cursor < event + length;)
+    if (strncmp(cursor, "ACTION=", strlen("ACTION=")))
+      if (strncmp(cursor, "DEVPATH_OLD=", strlen("DEVPATH_OLD=")))
+        if (strncmp(cursor, "SEQNUM=", strlen("SEQNUM="))) {
+          if (size + 1 + strlen(cursor) >= sizeof(record))
+            return;
+          size = stpcpy(record + size + 1, cursor) - record;
+        }
+  device_store(record, size + 1);
+  journal_add(seqnum, record, size + 1);
+}
+
+static void database_write(void) {
+  uint32_t *buckets, (*entries)[2], *offsets, count, length;
+  struct device **list, *device;
+  char *path, *value;
+  FILE *file;
+  int fd;
+
+  for (database.buckets = 1; database.buckets < stored; )
+    database.buckets <<= 1;
+  database.count = stored;
+
+  buckets = calloc(database.buckets, sizeof(*buckets));
+  entries = calloc(stored + 1, sizeof(*entries));
+  offsets = calloc(stored + 1, sizeof(*offsets));
+  list = calloc(stored + 1, sizeof(*list));
+  if (!buckets || !entries || !offsets || !list)
+    err(EXIT_FAILURE, "calloc");
+
+  /* Write to a temporary file then rename it over the old database. */
+  if (asprintf(&path, "%s.XXXXXX", dbfile) < 0)
+    err(EXIT_FAILURE, "asprintf");
+  if ((fd = mkstemp(path)) < 0)
+    err(EXIT_FAILURE, "mkstemp %s", path);
+  if (fchmod(fd, 0644) < 0 || !(file = fdopen(fd, "w")))
+    err(EXIT_FAILURE, "%s", path);
+  fwrite(&database, sizeof(database), 1, file);
+
+  count = 0;
+  for (size_t i = 0; i < DEVICES; i++)
+    for (device = devices[i]; device; device = device->next) {
+      list[count] = device;
+      offsets[count++] = ftell(file);
+      length = device->length;
+      fwrite(&length, sizeof(length), 1, file);
+      fwrite(device->event, 1, length, file);
+      fwrite("\0\0\0", 1, -length & 3, file);
+    }
+
+  for (size_t i = 0; i < sizeof(indexes) / sizeof(*indexes); i++) {
+    memset(buckets, 0, database.buckets * sizeof(*buckets));
+    count = 0;
+
+    for (size_t j = 0; j < stored; j++) {
+      value = property(list[j]->event, list[j]->length, indexes[i],
+        strlen(indexes[i]));
+      if (value) {
+        entries[count][0] = offsets[j];
+        entries[count][1] = buckets[hash(value) & (database.buckets - 1)];
+        buckets[hash(value) & (database.buckets - 1)] = ++count;
+      }
+    }
+
+    database.index[i][0] = ftell(file);
+    fwrite(buckets, sizeof(*buckets), database.buckets, file);
+    database.index[i][1] = ftell(file);
+    fwrite(entries, sizeof(*entries), count, file);
+  }
+
+  /* Keep the file open to append later changes to its journal. */
+  fwrite("\0\0\0\0", 1, -ftell(file) & 7, file);
+  dbend = database.journal = ftell(file);
+  rewind(file);
+  fwrite(&database, sizeof(database), 1, file);
+  if (fflush(file) != 0 || (fd = fcntl(fd, F_DUPFD_CLOEXEC, 0)) < 0)
+    err(EXIT_FAILURE, "%s", path);
+  if (fclose(file) != 0)
+    err(EXIT_FAILURE, "%s", path);
+  if (rename(path, dbfile) < 0)
+    err(EXIT_FAILURE, "rename %s", dbfile);
+  if (dbfd >= 0)
+    close(dbfd);
+  dbfd = fd;
+  journaled = 0;
+
+  free(buckets);
+  free(entries);
+  free(offsets);
+  free(list);
+  free(path);
+  dirty = 0;
+}
+
+static void database_flush(void) {
+  ssize_t count;
+  size_t done;
+
+  /* Rewrite everything after a rescan or once the journal has grown past
+     an eighth of the database, so both writing and reading it stay cheap. */
+  if (dirty || 8 * (dbend + journaled - database.journal) > database.journal) {
+    database_write();
+    return;
+  }
+
+  for (done = 0; done < journaled; done += count)
+    if ((count = pwrite(dbfd, journal + done, journaled - done,
+        dbend + done)) < 0) {
+      if (errno != EINTR)
+        err(EXIT_FAILURE, "write %s", dbfile);
+      count = 0;
+    }
+  dbend += journaled;
+  journaled = 0;
+}
+
+static int change_compare(const void *a, const void *b) {
+  const struct change *x = a, *y = b;
+
+  /* Sort by hash, then with the latest record for each DEVPATH first. */
+  if (x->hash != y->hash)
+    return x->hash < y->hash ? -1 : 1;
+  return x->offset > y->offset ? -1 : x->offset < y->offset;
+}
+
+static uint32_t change_find(struct database *database, char *devpath) {
+  char *base = (char *) database + sizeof(uint64_t) + sizeof(uint32_t);
+  size_t low = 0, high = changed, middle;
+  uint32_t value = hash(devpath);
+
+  /* Return the offset of the latest record for DEVPATH, or 0 if none. */
+  while (low < high) {
+    middle = (low + high) / 2;
+    if (changes[middle].hash < value)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+  for (; low < changed && changes[low].hash == value; low++)
+    if (!strcmp(strchr(base + changes[low].offset, '@') + 1, devpath))
+      return changes[low].offset;
+  return 0;
+}
+
+static struct database *database_open(char *path, size_t *size) {
+  struct database *database;
+  struct stat status;
+  uint64_t seqnum;
+  uint32_t offset, used;
+  size_t count = 0;
+  char *base, *event;
+  int fd;
+
+  if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+    err(EXIT_FAILURE, "%s", path);
+  if (fstat(fd, &status) < 0)
+    err(EXIT_FAILURE, "fstat %s", path);
+
+  *size = status.st_size;
+  if (*size < sizeof(*database))
+    errx(EXIT_FAILURE, "%s: Invalid device database", path);
+  database = mmap(NULL, *size, PROT_READ, MAP_SHARED, fd, 0);
+  if (database == MAP_FAILED)
+    err(EXIT_FAILURE, "mmap %s", path);
+  close(fd);
+
+  if (memcmp(database->magic, "uevent2", 8))
+    errx(EXIT_FAILURE, "%s: Invalid device database", path);
+  if (database->journal < sizeof(*database) || database->journal > *size)
+    errx(EXIT_FAILURE, "%s: Invalid device database", path);
+
+  /* Take journal records as far as whole ones have been written, ending
+     with the last one that completes a uevent. */
+  base = (char *) database;
+  latest = database->seqnum;
+  for (offset = database->journal; offset + 12 <= *size;
+      offset += (sizeof(seqnum) + sizeof(used) + used + 7) & ~7) {
+    memcpy(&seqnum, base + offset, sizeof(seqnum));
+    memcpy(&used, base + offset + sizeof(seqnum), sizeof(used));
+    event = base + offset + sizeof(seqnum) + sizeof(used);
+    if (used == 0 || used > BUFFER || event + used > base + *size)
+      break;
+    if (event[used - 1] || !memchr(event, '@', used))
+      break;
+
+    if (count % 64 == 0)
+      if (!(changes = realloc(changes, (count + 64) * sizeof(*changes))))
+        err(EXIT_FAILURE, "realloc");
+    changes[count].hash = hash(strchr(event, '@') + 1);
+    changes[count++].offset = offset;
+    if (seqnum > 0)
+      latest = seqnum, changed = count;
+  }
+  qsort(changes, changed, sizeof(*changes), change_compare);
+  return database;
+}
+
+static size_t database_query(struct database *database, size_t size,
+    char *filters, size_t length, void (*found)(char *, size_t)) {
+  char buffer[BUFFER + 1], *base = (char *) database, *filter, *pattern;
+  uint32_t entry = 0, *entries = NULL, offset = sizeof(*database), used;
+  size_t count = 0, key;
+
+  /* Follow an index chain if a filter exactly matches an indexed key. */
+  for (filter = filters; !entries && filter < filters + length; ) {
+    pattern = strchr(filter, '=') + 1;
+    key = pattern - filter - 1;
+    for (size_t i = 0; i < sizeof(indexes) / sizeof(*indexes); i++)
+      if (!strncmp(filter, indexes[i], key) && !indexes[i][key])
+        if (!strpbrk(pattern, "*?[\\(")) {
+          entries = (uint32_t *) (base + database->index[i][1]);
+          entry = ((uint32_t *) (base + database->index[i][0]))
+            [hash(pattern) & (database->buckets - 1)];
           break;
         }
+    filter = pattern + strlen(pattern) + 1;
+  }
+
+  /* Otherwise walk every device in turn. */
+  for (uint32_t i = 0; entries ? entry > 0 : i < database->count; i++) {
+    if (entries) {
+      offset = entries[2 * entry - 2];
+      entry = entries[2 * entry - 1];
+    }
+
+    if (offset + sizeof(used) > size)
+      break;
+    memcpy(&used, base + offset, sizeof(used));
+    if (used > BUFFER || offset + sizeof(used) + used > size)
+      break;
+
+    memcpy(buffer, base + offset + sizeof(used), used);
+    offset += sizeof(used) + ((used + 3) & ~3);
+    if (change_find(database, buffer + 4))
+      continue;
+    if (match(buffer, used, filters, length))
+      found(buffer, used), count++;
+  }
+
+  /* Then try the latest journal record for each device still present. */
+  for (size_t i = 0; i < changed; i++) {
+    offset = changes[i].offset + sizeof(uint64_t);
+    memcpy(&used, base + offset, sizeof(used));
+    memcpy(buffer, base + offset + sizeof(used), used);
+    if (strncmp(buffer, "add@", 4))
+      continue;
+    if (change_find(database, buffer + 4) != changes[i].offset)
+      continue;
+    if (match(buffer, used, filters, length))
+      found(buffer, used), count++;
+  }
+  return count;
+}
+
+static size_t pack(char *buffer, size_t size, char **filters) {
+  size_t length = 0;
+
+  /* Filters are passed around as consecutive null-terminated strings. */
+  for (; *filters; filters++) {
+    if (length + strlen(*filters) + 1 > size)
+      errx(EXIT_FAILURE, "Filters are too long");
+    length = stpcpy(buffer + length, *filters) - buffer + 1;
+  }
+  return length;
+}
+
+static int hub(char *path, char *seqnum, char *filters, size_t length) {
+  char message[BUFFER];
+  struct sockaddr_un address;
+  size_t size = strlen(path);
+  ssize_t count;
+  int sock;
+
+  if (size > sizeof(address.sun_path))
+    errx(EXIT_FAILURE, "Socket path is too long to connect");
+  size += offsetof(struct sockaddr_un, sun_path);
+
+  address.sun_family = AF_UNIX;
+  strncpy(address.sun_path, path, sizeof(address.sun_path));
+
+  if ((sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) < 0)
+    err(EXIT_FAILURE, "socket");
+  if (connect(sock, (struct sockaddr *) &address, size) < 0)
+    err(EXIT_FAILURE, "connect %s", path);
+
+  /* Send SEQNUM then the KEY=PATTERN filters, each null-terminated. */
+  size = snprintf(message, sizeof(message), "%s", seqnum ? seqnum : "") + 1;
+  if (size + length > sizeof(message))
+    errx(EXIT_FAILURE, "Filters are too long");
+  memcpy(message + size, filters, length);
+  if (send(sock, message, size + length, 0) < 0)
+    err(EXIT_FAILURE, "send");
+
+  /* An empty message acknowledges the subscription. */
+  while ((count = recv(sock, message, sizeof(message), 0)) < 0)
+    if (errno != EAGAIN && errno != EINTR)
+      err(EXIT_FAILURE, "recv");
+  if (count != 1 || *message != 0)
+    errx(EXIT_FAILURE, "%s: Subscription failed", path);
+  return sock;
+}
+
+static int subscribe(char *path, char *seqnum, char **filters) {
+  char buffer[BUFFER + 1], position[32];
+  struct database *database = NULL;
+  size_t length, size;
+  ssize_t count;
+  int sock;
+
+  /* Replay from the database SEQNUM so no event can fall between them. */
+  if (dbfile) {
+    database = database_open(dbfile, &size);
+    snprintf(position, sizeof(position), "%" PRIu64, latest);
+    seqnum = position;
+  }
+
+  length = pack(buffer, sizeof(buffer), filters);
+  sock = hub(path, seqnum, buffer, length);
+  putchar('\n');
+  fflush(stdout);
+
+  if (database) {
+    database_query(database, size, buffer, length, print);
+    munmap(database, size);
+  }
+
+  while ((count = recv(sock, buffer, sizeof(buffer) - 1, 0)) != 0)
+    if (count > 0)
+      print(buffer, count);
+    else if (errno != EAGAIN && errno != EINTR)
+      err(EXIT_FAILURE, "recv");
+  errx(EXIT_FAILURE, "%s: Connection closed", path);
+}
+
+static int query(char **filters) {
+  struct database *database;
+  char buffer[BUFFER];
+  size_t length, size;
+
+  database = database_open(dbfile, &size);
+  length = pack(buffer, sizeof(buffer), filters);
+  return database_query(database, size, buffer, length, print) ? 0 : 1;
+}
+
+static void found(char *event, size_t length) {
+  char *devpath = property(event, length, "DEVPATH", strlen("DEVPATH"));
+  int hit = 0;
+
+  for (size_t i = 0; i < grouped; i++)
+    if (!groups[i].matched)
+      if (match(event, length, groups[i].filters, groups[i].length))
+        groups[i].matched = hit = 1, unmatched--;
+
+  if (hit && devpath) {
+    printf("%s%s\n", getenv("SYSFS") ?: "/sys", devpath);
+    fflush(stdout);
+  }
+}
+
+static void rescan(void) {
+  struct device *device;
+
+  database_reset();
+  for (size_t i = 0; i < DEVICES; i++)
+    for (device = devices[i]; device; device = device->next)
+      found(device->event, device->length);
+}
+
+static double monotonic(void) {
+  struct timespec now;
 
-      /* Keep track of ACTION and DEVPATH for constructing header. */
-      if (strncmp(event + length, "ACTION=", strlen("ACTION=")) == 0)
-        action = event + length + strlen("ACTION=");
-      if (strncmp(event + length, "DEVPATH=", strlen("DEVPATH=")) == 0)
-        devpath = event + length + strlen("DEVPATH=");
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static int await(char **argv, double timeout) {
+  char buffer[BUFFER + 1], *path = getenv("UEVENTSOCK"), position[32];
+  struct database *database = NULL;
+  double deadline, remaining;
+  size_t size;
+  ssize_t length;
+  int delay;
+
+  /* Split the arguments into groups separated by --, each needing ACTION. */
+  for (grouped = 1, size = 0; argv[size]; size++)
+    grouped += !strcmp(argv[size], "--");
+  if (!(groups = calloc(grouped, sizeof(struct group))))
+    err(EXIT_FAILURE, "calloc");
+
+  for (size_t i = 0; i < grouped; i++, argv++) {
+    char *filters[BUFFER / 2] = { "ACTION=add" }, **filter = filters + 1;
+
+    for (; *argv && strcmp(*argv, "--"); argv++)
+      if (filter < filters + BUFFER / 2 - 1) {
+        if (strncmp(*argv, "ACTION=", strlen("ACTION=")) == 0)
+          *filters = *argv;
+        else
+          *filter++ = *argv;
+      }
+    groups[i].length = pack(groups[i].filters, BUFFER, filters);
+  }
+  unmatched = grouped;
+
+  deadline = monotonic() + timeout;
+
+  if (!(pollfd = calloc(grouped, sizeof(struct pollfd))))
+    err(EXIT_FAILURE, "calloc");
+
+  /* Subscribe each group to a hub if there is one, otherwise to netlink. */
+  if (path && *path) {
+    if ((dbfile = getenv("UEVENTDB")) && *dbfile) {
+      database = database_open(dbfile, &size);
+      snprintf(position, sizeof(position), "%" PRIu64, latest);
+    }
+    for (polled = 0; polled < grouped; polled++) {
+      pollfd[polled].fd = hub(path, database ? position : NULL,
+        groups[polled].filters, groups[polled].length);
+      pollfd[polled].events = POLLIN;
+    }
+  } else {
+    pollfd->fd = socket(PF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC,
+      NETLINK_KOBJECT_UEVENT);
+    if (pollfd->fd < 0)
+      err(EXIT_FAILURE, "socket");
+    netlink.nl_groups = 1;
+    if (bind(pollfd->fd, (struct sockaddr *) &netlink, sizeof(netlink)) < 0)
+      err(EXIT_FAILURE, "bind");
+    pollfd->events = POLLIN;
+    polled = 1;
+  }
+
+  /* Look for existing devices once we are sure not to miss new ones. */
+  if (database) {
+    for (size_t i = 0; i < grouped; i++)
+      database_query(database, size, groups[i].filters, groups[i].length,
+        found);
+    munmap(database, size);
+  } else {
+    rescan();
+  }
+
+  while (unmatched) {
+    /* Wake at least once a minute so a long timeout cannot overflow. */
+    delay = -1;
+    if (timeout >= 0) {
+      if ((remaining = deadline - monotonic()) <= 0)
+        return EXIT_FAILURE;
+      delay = remaining < 60 ? 1 + 1000 * remaining : 60000;
+    }
 
-      length += count + 1;
+    if (poll(pollfd, polled, delay) < 0) {
+      if (errno != EAGAIN && errno != EINTR)
+        err(EXIT_FAILURE, "poll");
       continue;
     }
 
-    if (action && devpath) {
-      /* Make space for the ACTION@DEVPATH header then prepend it. */
-      count = 2 + strlen(action) + strlen(devpath);
+    for (size_t i = 0; i < polled; i++) {
+      if (!(pollfd[i].revents & (POLLIN | POLLERR | POLLHUP)))
+        continue;
+      if ((length = recv(pollfd[i].fd, buffer, BUFFER, 0)) < 0) {
+        /* Events may have been lost, so look again at existing devices. */
+        if (errno == ENOBUFS)
+          rescan();
+        else if (errno != EAGAIN && errno != EINTR)
+          err(EXIT_FAILURE, "recv");
+      } else if (length == 0) {
+        errx(EXIT_FAILURE, "%s: Connection closed", path);
+      } else if (buffer[length] = 0, !strcmp(buffer, "overflow@")) {
+        /* The hub dropped events for us, so look at existing devices. */
+        rescan();
+      } else {
+        found(buffer, length);
+      }
+    }
+  }
+  return EXIT_SUCCESS;
+}
 
-      while (size < length + count)
-        if (event = realloc(event, size += 4096), event == NULL)
-          err(EXIT_FAILURE, "realloc");
+static void record(char *event, size_t length) {
+  struct timespec now;
+  uint64_t header[2];
+  struct iovec iovecs[2] = {
+    { header, sizeof(header) }, { event, length }
+  };
 
-      memmove(event + count, event, length);
-      snprintf(event, count, "%s@%s", action + count, devpath + count);
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  header[0] = now.tv_sec * 1000000000ull + now.tv_nsec;
+  header[1] = length;
 
-      /* Attempt to broadcast uevent but tolerate failures. */
-      while (send(sock, event, length + count, 0) < 0)
-        if (errno != EAGAIN && errno != EINTR)
-          break;
+  /* Append each uevent with one write so a recording is never torn. */
+  while (writev(recording, iovecs, 2) < 0)
+    if (errno != EAGAIN && errno != EINTR)
+      err(EXIT_FAILURE, "write");
+}
+
+static int playback(char *path, int pace) {
+  char buffer[BUFFER + 1], header[sizeof(magic)];
+  struct timespec start, when;
+  uint64_t first = 0, offset, timing[2];
+  FILE *file;
+
+  if (!(file = fopen(path, "re")))
+    err(EXIT_FAILURE, "%s", path);
+  if (fread(header, sizeof(header), 1, file) != 1)
+    errx(EXIT_FAILURE, "%s: Invalid recording", path);
+  if (memcmp(header, magic, sizeof(magic)))
+    errx(EXIT_FAILURE, "%s: Invalid recording", path);
+
+  putchar('\n');
+  fflush(stdout);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  while (fread(timing, sizeof(timing), 1, file) == 1) {
+    if (timing[1] == 0 || timing[1] > BUFFER)
+      errx(EXIT_FAILURE, "%s: Invalid recording", path);
+    if (fread(buffer, timing[1], 1, file) != 1)
+      errx(EXIT_FAILURE, "%s: Truncated recording", path);
+
+    /* Sleep until the same time has passed as when it was recorded. */
+    if (pace) {
+      first = first ? first : timing[0];
+      offset = start.tv_nsec + timing[0] - first;
+      when.tv_sec = start.tv_sec + offset / 1000000000;
+      when.tv_nsec = offset % 1000000000;
+      while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &when, 0) == EINTR)
+        continue;
     }
-    action = devpath = NULL, length = 0;
+    print(buffer, timing[1]);
   }
 
-  free(line);
-  close(sock);
-  return ferror(stdin) ? EXIT_FAILURE : EXIT_SUCCESS;
+  if (ferror(file))
+    err(EXIT_FAILURE, "read %s", path);
+  fclose(file);
+  return EXIT_SUCCESS;
+}
+
+static unsigned mask(char *mask) {
+  unsigned groups = strtoul(mask, NULL, 0);
+
+  if (groups == 0)
+    errx(EXIT_FAILURE, "Invalid netlink group mask: %s", mask);
+  return groups;
 }
 
 void usage(char *progname) {
+  if (!strcmp(program_invocation_short_name, "ueventwait")) {
+    fprintf(stderr, "\
+Usage: %s [-t TIMEOUT] KEY=PATTERN... [-- KEY=PATTERN...]...\n\
+Wait until a device matching each group of patterns exists, printing the\n\
+sysfs path of each device as it is found. Exit with status 1 if TIMEOUT\n\
+seconds pass first.\n\
+", progname);
+    exit(64);
+  }
+
   fprintf(stderr, "\
 Usage:\n\
   %1$s -l GROUPS  listen for uevents, printing them to stdout\n\
-  %1$s -b GROUPS  read uevents from stdin and broadcast them\n\
+  %1$s -b GROUPS [-0]\n\
+                read uevents from stdin and broadcast them, with each\n\
+                  property null-terminated rather than on a line if -0\n\
+  %1$s -l GROUPS -s SOCKET\n\
+                listen for uevents, serving them to clients of SOCKET\n\
+  %1$s -c SOCKET [-n SEQNUM] [KEY=PATTERN]...\n\
+                receive matching uevents from SOCKET, printing them to\n\
+                  stdout, replaying recent uevents after SEQNUM if given\n\
+  %1$s -q DBFILE [KEY=PATTERN]...\n\
+                print devices in DBFILE matching all the given patterns\n\
+  %1$s -p FILE [-t]\n\
+                print uevents recorded in FILE as fast as possible, or\n\
+                  at the pace they were recorded with -t\n\
+Options:\n\
+  -d DBFILE     with -l, keep a database of current devices in DBFILE;\n\
+                  with -c, first print matching devices from DBFILE\n\
+  -w FILE       with -l, also record uevents with timestamps to FILE,\n\
+                  replacing any existing contents\n\
 ", progname);
   exit(64);
 }
 
 int main(int argc, char **argv) {
-  char buffer[BUFFER + 1], *cursor, *separator;
-  int sock, socksize = 1 << 21;
+  char buffer[BUFFER + 1], delimiter = '\n', *path = NULL, *seqnum = NULL;
+  char *output = NULL;
+  int mode = 0, option, pace = 0, sock, socksize = 1 << 21;
+  double timeout = -1;
   ssize_t length;
 
-  if (argc == 3 && strcmp(argv[1], "-b") == 0) {
-    netlink.nl_groups = strtoul(argv[2], NULL, 0);
-    if (netlink.nl_groups == 0)
-      errx(EXIT_FAILURE, "Invalid netlink group mask: %s", argv[2]);
-    return broadcast();
+  /* Installed as a hard link, ueventwait runs in wait mode. */
+  if (!strcmp(program_invocation_short_name, "ueventwait")) {
+    while ((option = getopt(argc, argv, "+:t:")) > 0)
+      switch (option) {
+        case 't':
+          timeout = strtod(optarg, &path);
+          if (!*optarg || *path || !(timeout >= 0))
+            errx(EXIT_FAILURE, "Invalid TIMEOUT: %s", optarg);
+          break;
+        default:
+          usage(argv[0]);
+      }
+
+    /* Every group of patterns separated by -- must be non-empty. */
+    for (int i = optind; i <= argc; i++)
+      if (i == argc || !strcmp(argv[i], "--")) {
+        if (i == optind || !strcmp(argv[i - 1], "--"))
+          usage(argv[0]);
+      } else if (*argv[i] == '=' || !strchr(argv[i], '=')) {
+        usage(argv[0]);
+      }
+    return await(argv + optind, timeout);
   }
 
-  if (argc == 3 && strcmp(argv[1], "-l") == 0) {
-    netlink.nl_groups = strtoul(argv[2], NULL, 0);
-    if (netlink.nl_groups == 0)
-      errx(EXIT_FAILURE, "Invalid netlink group mask: %s", argv[2]);
-  } else {
+  while ((option = getopt(argc, argv, ":0b:c:d:l:n:p:q:s:tw:")) > 0)
+    switch (option) {
+      case '0':
+        delimiter = 0;
+        break;
+      case 'b':
+      case 'l':
+        netlink.nl_groups = mask(optarg);
+        /* Fall through to record the mode. */
+      case 'c':
+      case 'p':
+      case 'q':
+        if (mode)
+          usage(argv[0]);
+        if ((mode = option) == 'c' || option == 'p')
+          path = optarg;
+        if (option == 'q')
+          dbfile = optarg;
+        break;
+      case 'd':
+        dbfile = optarg;
+        break;
+      case 'n':
+        if (!*optarg || strlen(optarg) > 20)
+          errx(EXIT_FAILURE, "Invalid SEQNUM: %s", optarg);
+        if (optarg[strspn(optarg, "0123456789")])
+          errx(EXIT_FAILURE, "Invalid SEQNUM: %s", optarg);
+        seqnum = optarg;
+        break;
+      case 's':
+        path = optarg;
+        break;
+      case 't':
+        pace = 1;
+        break;
+      case 'w':
+        output = optarg;
+        break;
+      default:
+        usage(argv[0]);
+    }
+
+  if (mode != 'b' && delimiter == 0)
+    usage(argv[0]);
+  if (mode != 'l' && output)
     usage(argv[0]);
+  if (mode != 'p' && pace)
+    usage(argv[0]);
+
+  if (mode == 'p') {
+    if (optind < argc || dbfile || seqnum)
+      usage(argv[0]);
+    return playback(path, pace);
   }
 
+  if (mode == 'c' || mode == 'q') {
+    for (int i = optind; i < argc; i++)
+      if (*argv[i] == '=' || !strchr(argv[i], '='))
+        usage(argv[0]);
+    if (mode == 'q')
+      return query(argv + optind);
+    return subscribe(path, seqnum, argv + optind);
+  }
+
+  if (mode == 0 || optind < argc || seqnum)
+    usage(argv[0]);
+  if (mode == 'b' && (path || dbfile))
+    usage(argv[0]);
+  if (mode == 'b')
+    return broadcast(delimiter);
+
   if ((sock = socket(PF_NETLINK, SOCK_DGRAM, NETLINK_KOBJECT_UEVENT)) < 0)
     err(EXIT_FAILURE, "socket");
 
@@ -118,43 +1282,83 @@ int main(int argc, char **argv) {
   if (bind(sock, (struct sockaddr *) &netlink, sizeof(netlink)) < 0)
     err(EXIT_FAILURE, "bind");
 
-  putchar('\n');
-  fflush(stdout);
+  if (output) {
+    recording = open(output, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (recording < 0)
+      err(EXIT_FAILURE, "%s", output);
+    while (write(recording, magic, sizeof(magic)) < 0)
+      if (errno != EAGAIN && errno != EINTR)
+        err(EXIT_FAILURE, "write %s", output);
+  }
+
+  /* Scan existing devices after binding so no uevent can be missed. */
+  if (dbfile) {
+    database_reset();
+    database_write();
+  }
+
+  /* The hub can only replay events that arrive after it starts. */
+  if (path) {
+    horizon = kernel_seqnum();
+    serve_open(sock, path);
+  } else {
+    putchar('\n');
+    fflush(stdout);
+  }
 
   while (1) {
+    /* Only rewrite the database once pending uevents are processed. */
+    if (dirty || journaled)
+      if (!poll(&(struct pollfd) { sock, POLLIN }, 1, 0))
+        database_flush();
+
+    if (path) {
+      while (poll(pollfd, polled, -1) < 0)
+        if (errno != EAGAIN && errno != EINTR)
+          err(EXIT_FAILURE, "poll");
+
+      /* Walk clients backwards as serve_drop() moves the last one down. */
+      for (size_t i = polled - 1; i >= 2; i--)
+        if (pollfd[i].revents & (POLLIN | POLLERR | POLLHUP))
+          serve_subscribe(i);
+        else if (pollfd[i].revents & POLLOUT)
+          serve_send(i, NULL, 0);
+      if (pollfd[1].revents & POLLIN)
+        serve_accept(pollfd[1].fd);
+      if (!(pollfd[0].revents & POLLIN))
+        continue;
+    }
+
     if ((length = recv(sock, &buffer, sizeof(buffer) - 1, 0)) < 0) {
       if (errno == ENOBUFS) {
-        printf("ACTION overflow\n\n");
-        fflush(stdout);
+        /* Uevents have been lost so the database must be rebuilt. */
+        if (dbfile)
+          database_reset();
+        if (recording >= 0)
+          record(overflow, sizeof(overflow));
+        if (path) {
+          horizon = kernel_seqnum();
+          for (size_t i = 2; i < polled; i++)
+            if ((clients[i].overflow = clients[i].subscribed))
+              serve_send(i, NULL, 0);
+        } else {
+          printf("ACTION overflow\n\n");
+          fflush(stdout);
+        }
       } else if (errno != EAGAIN && errno != EINTR) {
         err(EXIT_FAILURE, "recv");
       }
       continue;
     }
 
-    /* Null-terminate the uevent and replace stray newlines with spaces. */
     buffer[length] = 0;
-    for (cursor = buffer; cursor < buffer + length; cursor++)
-      if (*cursor == '\n')
-        *cursor = ' ';
-
-    if (strlen(buffer) >= length - 1) {
-      /* No properties; fake a simple environment based on the header. */
-      if ((cursor = strchr(buffer, '@'))) {
-        *cursor++ = 0;
-        printf("ACTION %s\n", buffer);
-        printf("DEVPATH %s\n", cursor);
-      }
-    } else {
-      /* Ignore header as properties will include ACTION and DEVPATH. */
-      cursor = buffer;
-      while (cursor += strlen(cursor) + 1, cursor < buffer + length) {
-        if ((separator = strchr(cursor, '=')))
-          *separator = ' ';
-        puts(cursor);
-      }
-    }
-    putchar('\n');
-    fflush(stdout);
+    if (recording >= 0)
+      record(buffer, length);
+    if (dbfile)
+      database_update(buffer, length);
+    if (path)
+      serve_event(buffer, length);
+    else
+      print(buffer, length);
   }
 }